@@ -0,0 +1,1179 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compressed audio sink implementation. Accepts the payload of an
+ * IEC 61937 data burst (AC3, E-AC3, DTS, DTS-HD, TrueHD, MPEG audio,
+ * or AAC), decodes it with the matching libavcodec decoder, and then
+ * hands the interleaved frames to the sink core (the same one that the
+ * PCM sink uses), which resamples them and passes them to the Pulseaudio
+ * sink with whatever channel layout the stream has. All of the formats
+ * share the same decode path, and a new one just needs an entry in the
+ * format table.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "compressed_sink.h"
+#include "config.h"
+
+/* Returns the size of the rate loop history for frames of the given
+ * size. The loop is updated once per decoded frame, so the averaging
+ * window is scaled to cover about the same amount of time no matter
+ * how big the frames of the current format are.
+ */
+static uint32_t loop_hist_size(uint32_t frame_size)
+{
+    uint32_t hist_size;
+    const uint32_t wanted = (COMPRESSED_SINK_BUFFER_HIST_SIZE * COMPRESSED_SINK_FRAME_SIZE) / frame_size;
+
+    /* Has to be a power of 2. */
+    hist_size = 1;
+    while (((hist_size * 2u) <= wanted) && ((hist_size * 2u) <= RATE_LOOP_MAX_HIST_SIZE)) {
+        hist_size *= 2u;
+    }
+
+    return hist_size;
+}
+
+/* libavcodec decoder for each entry in inst->decoders. */
+static const enum AVCodecID decoder_ids[COMPRESSED_SINK_NR_DECODERS] = {
+    [COMPRESSED_SINK_DECODER_AC3]    = AV_CODEC_ID_AC3,
+    [COMPRESSED_SINK_DECODER_EAC3]   = AV_CODEC_ID_EAC3,
+    [COMPRESSED_SINK_DECODER_DTS]    = AV_CODEC_ID_DTS,
+    [COMPRESSED_SINK_DECODER_MP1]    = AV_CODEC_ID_MP1,
+    [COMPRESSED_SINK_DECODER_MP2]    = AV_CODEC_ID_MP2,
+    [COMPRESSED_SINK_DECODER_MP3]    = AV_CODEC_ID_MP3,
+    [COMPRESSED_SINK_DECODER_AAC]    = AV_CODEC_ID_AAC,
+    [COMPRESSED_SINK_DECODER_TRUEHD] = AV_CODEC_ID_TRUEHD,
+};
+
+struct compressed_sink_format {
+    uint16_t data_type;
+    enum compressed_sink_decoder_idx decoder;
+    /* Splits the burst up into packets and decodes them. */
+    void (*decode)(struct compressed_sink *inst,
+                   const struct compressed_sink_format *format,
+                   uint8_t *data,
+                   size_t len);
+};
+
+/* Throw away anything buffered up in the decoders. */
+static void flush_decoders(struct compressed_sink *inst)
+{
+    uint32_t i;
+
+    for (i = 0; i < COMPRESSED_SINK_NR_DECODERS; i++) {
+        if (inst->decoders[i].cctx) {
+            avcodec_flush_buffers(inst->decoders[i].cctx);
+        }
+    }
+}
+
+/* Downmix gains. The center and surrounds go in at -3 dB, and the LFE
+ * is just dropped, like most downmixes do.
+ */
+#define DOWNMIX_3DB                    0.70710678f
+
+struct compressed_sink_channel {
+    uint64_t av_channel;
+    pa_channel_position_t position;
+    /* How much of the channel goes into each channel of a stereo and
+     * a quad (FL, FR, RL, RR) downmix.
+     */
+    float stereo[2];
+    float quad[4];
+};
+
+/* Every channel that the decoders can put out, in AV_CH_* order.
+ * Between them, these cover all of the AC3 modes (1/0 through 3/2,
+ * with or without the LFE), DTS, and the 7.1 layouts that E-AC3 and
+ * TrueHD build with their extra channels. Channels that Pulseaudio
+ * has no position for go out on the next free AUX position.
+ */
+static const struct compressed_sink_channel channel_table[] = {
+    { AV_CH_FRONT_LEFT,            PA_CHANNEL_POSITION_FRONT_LEFT,
+      { 1, 0 },                     { 1, 0, 0, 0 } },
+    { AV_CH_FRONT_RIGHT,           PA_CHANNEL_POSITION_FRONT_RIGHT,
+      { 0, 1 },                     { 0, 1, 0, 0 } },
+    { AV_CH_FRONT_CENTER,          PA_CHANNEL_POSITION_FRONT_CENTER,
+      { DOWNMIX_3DB, DOWNMIX_3DB }, { DOWNMIX_3DB, DOWNMIX_3DB, 0, 0 } },
+    { AV_CH_LOW_FREQUENCY,         PA_CHANNEL_POSITION_LFE,
+      { 0, 0 },                     { 0, 0, 0, 0 } },
+    { AV_CH_BACK_LEFT,             PA_CHANNEL_POSITION_REAR_LEFT,
+      { DOWNMIX_3DB, 0 },           { 0, 0, 1, 0 } },
+    { AV_CH_BACK_RIGHT,            PA_CHANNEL_POSITION_REAR_RIGHT,
+      { 0, DOWNMIX_3DB },           { 0, 0, 0, 1 } },
+    { AV_CH_FRONT_LEFT_OF_CENTER,  PA_CHANNEL_POSITION_FRONT_LEFT_OF_CENTER,
+      { 1, 0 },                     { 1, 0, 0, 0 } },
+    { AV_CH_FRONT_RIGHT_OF_CENTER, PA_CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER,
+      { 0, 1 },                     { 0, 1, 0, 0 } },
+    /* The single surround of the 2/1 and 3/1 modes. */
+    { AV_CH_BACK_CENTER,           PA_CHANNEL_POSITION_REAR_CENTER,
+      { 0.5f, 0.5f },               { 0, 0, DOWNMIX_3DB, DOWNMIX_3DB } },
+    { AV_CH_SIDE_LEFT,             PA_CHANNEL_POSITION_SIDE_LEFT,
+      { DOWNMIX_3DB, 0 },           { 0, 0, 1, 0 } },
+    { AV_CH_SIDE_RIGHT,            PA_CHANNEL_POSITION_SIDE_RIGHT,
+      { 0, DOWNMIX_3DB },           { 0, 0, 0, 1 } },
+    /* E-AC3 and DTS-HD overhead channel. */
+    { AV_CH_TOP_CENTER,            PA_CHANNEL_POSITION_TOP_CENTER,
+      { DOWNMIX_3DB, DOWNMIX_3DB }, { 0.5f, 0.5f, 0.5f, 0.5f } },
+    /* E-AC3 front height channels. */
+    { AV_CH_TOP_FRONT_LEFT,        PA_CHANNEL_POSITION_TOP_FRONT_LEFT,
+      { DOWNMIX_3DB, 0 },           { DOWNMIX_3DB, 0, 0, 0 } },
+    { AV_CH_TOP_FRONT_RIGHT,       PA_CHANNEL_POSITION_TOP_FRONT_RIGHT,
+      { 0, DOWNMIX_3DB },           { 0, DOWNMIX_3DB, 0, 0 } },
+    /* E-AC3 and DTS-HD wide channels, between the fronts and sides. */
+    { AV_CH_WIDE_LEFT,             PA_CHANNEL_POSITION_INVALID,
+      { 1, 0 },                     { DOWNMIX_3DB, 0, DOWNMIX_3DB, 0 } },
+    { AV_CH_WIDE_RIGHT,            PA_CHANNEL_POSITION_INVALID,
+      { 0, 1 },                     { 0, DOWNMIX_3DB, 0, DOWNMIX_3DB } },
+#ifdef AV_CH_LOW_FREQUENCY_2
+    { AV_CH_LOW_FREQUENCY_2,       PA_CHANNEL_POSITION_INVALID,
+      { 0, 0 },                     { 0, 0, 0, 0 } },
+#endif
+    /* Anything else. It's played on its own AUX position, but left out
+     * of the downmix, since there's no telling where it belongs.
+     */
+    { 0,                           PA_CHANNEL_POSITION_INVALID,
+      { 0, 0 },                     { 0, 0, 0, 0 } },
+};
+
+#define NR_CHANNEL_TABLE_ENTRIES       (sizeof(channel_table) / sizeof(channel_table[0]))
+#define UNKNOWN_CHANNEL_IDX            (NR_CHANNEL_TABLE_ENTRIES - 1u)
+
+/* Planar float interleave kernels, one for each channel count, so that
+ * the inner loop has a fixed trip count and can be unrolled.
+ */
+#define INTERLEAVE_FLTP(n)                                              \
+static void interleave_fltp_##n(float *out, const AVFrame *frame)       \
+{                                                                       \
+    size_t i;                                                           \
+    uint32_t ch;                                                        \
+                                                                        \
+    for (i = 0; i < (size_t)frame->nb_samples; i++) {                   \
+        for (ch = 0; ch < (n); ch++) {                                  \
+            *out++ = ((const float *)frame->data[ch])[i];               \
+        }                                                               \
+    }                                                                   \
+}
+
+INTERLEAVE_FLTP(2)
+INTERLEAVE_FLTP(3)
+INTERLEAVE_FLTP(4)
+INTERLEAVE_FLTP(5)
+INTERLEAVE_FLTP(6)
+INTERLEAVE_FLTP(7)
+INTERLEAVE_FLTP(8)
+
+/* Mono goes to both of the front channels. */
+static void interleave_fltp_mono(float *out, const AVFrame *frame)
+{
+    size_t i;
+
+    for (i = 0; i < (size_t)frame->nb_samples; i++) {
+        *out++ = ((const float *)frame->data[0])[i];
+        *out++ = ((const float *)frame->data[0])[i];
+    }
+}
+
+/* Downmix kernels, one for each pair of output (stereo or quad) and
+ * decoded channel counts, so that both inner loops have a fixed trip
+ * count and can be unrolled. The downmix is done in place, and the
+ * output frame overlaps the input frame, so the whole input frame has
+ * to be read before any of the output frame is written.
+ */
+#define DOWNMIX(out_n, in_n)                                                \
+static void downmix_##out_n##_##in_n(float *buf,                            \
+                                     const float (*gains)[COMPRESSED_SINK_MAX_CHANNELS], \
+                                     size_t nr_frames)                      \
+{                                                                           \
+    size_t f;                                                               \
+    uint32_t o;                                                             \
+    uint32_t i;                                                             \
+    float acc[(out_n)];                                                     \
+    const float *in = buf;                                                  \
+    float *out = buf;                                                       \
+                                                                            \
+    for (f = 0; f < nr_frames; f++) {                                       \
+        for (o = 0; o < (out_n); o++) {                                     \
+            acc[o] = 0;                                                     \
+            for (i = 0; i < (in_n); i++) {                                  \
+                acc[o] += gains[o][i] * in[i];                              \
+            }                                                               \
+        }                                                                   \
+                                                                            \
+        for (o = 0; o < (out_n); o++) {                                     \
+            out[o] = acc[o];                                                \
+        }                                                                   \
+                                                                            \
+        in += (in_n);                                                       \
+        out += (out_n);                                                     \
+    }                                                                       \
+}
+
+DOWNMIX(2, 3)
+DOWNMIX(2, 4)
+DOWNMIX(2, 5)
+DOWNMIX(2, 6)
+DOWNMIX(2, 7)
+DOWNMIX(2, 8)
+DOWNMIX(4, 5)
+DOWNMIX(4, 6)
+DOWNMIX(4, 7)
+DOWNMIX(4, 8)
+
+typedef void (*downmix_kernel_fn)(float *buf,
+                                  const float (*gains)[COMPRESSED_SINK_MAX_CHANNELS],
+                                  size_t nr_frames);
+
+/* Indexed by the decoded channel count. */
+static const downmix_kernel_fn downmix_kernels_stereo[COMPRESSED_SINK_MAX_CHANNELS + 1] = {
+    [3] = downmix_2_3,
+    [4] = downmix_2_4,
+    [5] = downmix_2_5,
+    [6] = downmix_2_6,
+    [7] = downmix_2_7,
+    [8] = downmix_2_8,
+};
+
+static const downmix_kernel_fn downmix_kernels_quad[COMPRESSED_SINK_MAX_CHANNELS + 1] = {
+    [5] = downmix_4_5,
+    [6] = downmix_4_6,
+    [7] = downmix_4_7,
+    [8] = downmix_4_8,
+};
+
+/* Kernel for each decoded channel count. */
+static void (*const interleave_fltp[COMPRESSED_SINK_MAX_CHANNELS + 1])(float *out, const AVFrame *frame) = {
+    [1] = interleave_fltp_mono,
+    [2] = interleave_fltp_2,
+    [3] = interleave_fltp_3,
+    [4] = interleave_fltp_4,
+    [5] = interleave_fltp_5,
+    [6] = interleave_fltp_6,
+    [7] = interleave_fltp_7,
+    [8] = interleave_fltp_8,
+};
+
+/* Set up the layout for the given AV_CH_* mask. Returns false if it
+ * has a channel that isn't in the channel table, or too many of them.
+ */
+static bool init_layout(struct compressed_sink_layout *layout, uint64_t mask)
+{
+    uint32_t i;
+    uint32_t n;
+    uint32_t aux;
+    uint64_t bit;
+    pa_channel_position_t position;
+
+    memset(layout, 0, sizeof(struct compressed_sink_layout));
+    layout->mask = mask;
+
+    if (mask && !(mask & (mask - 1u))) {
+        /* Mono. */
+        layout->channels = 2;
+        layout->map.channels = 2;
+        layout->map.map[0] = PA_CHANNEL_POSITION_FRONT_LEFT;
+        layout->map.map[1] = PA_CHANNEL_POSITION_FRONT_RIGHT;
+        layout->table_idx[0] = 0;
+        layout->table_idx[1] = 1;
+        layout->interleave = interleave_fltp_mono;
+        return true;
+    }
+
+    n = 0;
+    aux = 0;
+    for (bit = 1; bit && (bit <= mask); bit <<= 1u) {
+        if (!(mask & bit)) {
+            continue;
+        }
+
+        if (n == COMPRESSED_SINK_MAX_CHANNELS) {
+            return false;
+        }
+
+        for (i = 0; i < UNKNOWN_CHANNEL_IDX; i++) {
+            if (channel_table[i].av_channel == bit) {
+                break;
+            }
+        }
+
+        position = channel_table[i].position;
+        if (position == PA_CHANNEL_POSITION_INVALID) {
+            position = PA_CHANNEL_POSITION_AUX0 + aux;
+            aux++;
+        }
+#ifndef USE_AC3_SURROUND_MAPPING
+        /* See config.h. The side channels only keep their own position
+         * when there are back channels too (like in 7.1).
+         */
+        if (!(mask & (AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT))) {
+            if (bit == AV_CH_SIDE_LEFT) {
+                position = PA_CHANNEL_POSITION_REAR_LEFT;
+            } else if (bit == AV_CH_SIDE_RIGHT) {
+                position = PA_CHANNEL_POSITION_REAR_RIGHT;
+            }
+        }
+#endif
+
+        layout->table_idx[n] = i;
+        layout->map.map[n] = position;
+        n++;
+    }
+
+    if (!n) {
+        return false;
+    }
+
+    layout->channels = n;
+    layout->map.channels = n;
+    layout->interleave = interleave_fltp[n];
+
+    return true;
+}
+
+/* Returns the AV_CH_* mask of a decoded frame. Not all of the decoders
+ * fill the layout in, so the usual one for the channel count is
+ * assumed if it's missing.
+ */
+static uint64_t frame_layout(AVFrame *frame)
+{
+    if (frame->channel_layout &&
+        (av_get_channel_layout_nb_channels(frame->channel_layout) == frame->channels)) {
+        return frame->channel_layout;
+    }
+
+    switch (frame->channels) {
+    case 1:
+        return AV_CH_LAYOUT_MONO;
+    case 2:
+        return AV_CH_LAYOUT_STEREO;
+    case 6:
+        return AV_CH_LAYOUT_5POINT1;
+    case 8:
+        return AV_CH_LAYOUT_7POINT1;
+    default:
+        return 0;
+    }
+}
+
+/* Returns the number of channels to send to a sink with the given
+ * channel map. Stereo and quad sinks get a downmix, so that channels
+ * that they don't have aren't resampled and sent over just to be mixed
+ * away by the server. Anything else gets the decoded layout.
+ */
+static uint32_t output_channels(struct compressed_sink *inst, const pa_channel_map *map)
+{
+    if (!pa_channel_map_has_position(map, PA_CHANNEL_POSITION_FRONT_LEFT) ||
+        !pa_channel_map_has_position(map, PA_CHANNEL_POSITION_FRONT_RIGHT)) {
+        return inst->layout.channels;
+    }
+
+    if ((map->channels == 2) && (inst->layout.channels > 2)) {
+        return 2;
+    }
+
+    if ((map->channels == 4) && (inst->layout.channels > 4) &&
+        pa_channel_map_has_position(map, PA_CHANNEL_POSITION_REAR_LEFT) &&
+        pa_channel_map_has_position(map, PA_CHANNEL_POSITION_REAR_RIGHT)) {
+        return 4;
+    }
+
+    return inst->layout.channels;
+}
+
+/* Initialize the compressed sink. This sets up everything that is expensive
+ * to create (the decoder and the rate converter), so that it's ready
+ * to go by the time the first burst shows up. This only needs to be
+ * called once, and the sink can then be opened and closed any number
+ * of times.
+ */
+void compressed_sink_init(struct compressed_sink *inst)
+{
+    uint32_t i;
+    bool have_sink;
+    pa_channel_map sink_map;
+    struct compressed_sink_decoder *dec;
+    struct sink_core_config config = {
+        .name = "61937",
+        .pa_buffer_size = COMPRESSED_SINK_PA_BUFFER_SIZE,
+        .target = COMPRESSED_SINK_BUFFER_TARGET_SAMPLES,
+        .loop_gain = COMPRESSED_SINK_LOOP_GAIN,
+        .hist_size = loop_hist_size(COMPRESSED_SINK_FRAME_SIZE),
+        .jitter_bucket_width = COMPRESSED_SINK_JITTER_BUCKET_WIDTH,
+        /* A partial frame would just be a glitch anyway. */
+        .drop_whole_blocks = true,
+    };
+
+    memset(inst, 0, sizeof(struct compressed_sink));
+
+    SINK_CORE_CONFIG_STORAGE(&config, &inst->storage);
+    sink_core_init(&inst->core, &config);
+
+    /* Most formats decode to 48 kHz 5.1. This follows the decoder if not. */
+    inst->rate = 48000;
+    init_layout(&inst->layout, AV_CH_LAYOUT_5POINT1);
+    inst->channels = inst->layout.channels;
+
+    /* Open decoder context. */
+#ifdef FFMPEG_OLD_AUDIO_API
+    inst->packet = malloc(sizeof(AVPacket));
+    av_init_packet(inst->packet);
+#else
+    inst->packet = av_packet_alloc();
+#endif
+    inst->frame = av_frame_alloc();
+
+    /* TODO - Handle all of these failure cases. */
+
+    for (i = 0; i < COMPRESSED_SINK_NR_DECODERS; i++) {
+        dec = &inst->decoders[i];
+
+        dec->codec = avcodec_find_decoder(decoder_ids[i]);
+        if (!dec->codec) {
+            printf("Can't find %s decoder\n", avcodec_get_name(decoder_ids[i]));
+            continue;
+        }
+
+        dec->cctx = avcodec_alloc_context3(dec->codec);
+        if (!dec->cctx) {
+            printf("Couldn't allocate codec context\n");
+            continue;
+        }
+
+        if (avcodec_open2(dec->cctx, dec->codec, NULL) < 0) {
+            printf("Couldn't open codec\n");
+        }
+    }
+
+    /* Get the converter ready for the channel count that the first
+     * open will actually use, which is the downmix for a stereo or
+     * quad sink. The connection is only needed for the lookup.
+     */
+    have_sink = (pa_output_connect(&inst->core.output) == 0) &&
+                (pa_output_get_sink_spec(&inst->core.output, NULL, &sink_map) == 0);
+    pa_output_close(&inst->core.output);
+
+    sink_core_prepare(&inst->core,
+                      inst->rate,
+                      have_sink ? output_channels(inst, &sink_map) : inst->layout.channels);
+}
+
+/* Set up the downmix from the decoded layout to inst->channels (stereo
+ * or quad). The gains come from the channel table, and each row gets
+ * normalized so that the result can't clip.
+ */
+static void init_downmix(struct compressed_sink *inst)
+{
+    uint32_t o;
+    uint32_t i;
+    float sum;
+    const struct compressed_sink_channel *chan;
+
+    memset(inst->downmix, 0, sizeof(inst->downmix));
+
+    inst->downmix_kernel = (inst->channels == 2) ?
+                           downmix_kernels_stereo[inst->layout.channels] :
+                           downmix_kernels_quad[inst->layout.channels];
+
+    for (o = 0; o < inst->channels; o++) {
+        sum = 0;
+        for (i = 0; i < inst->layout.channels; i++) {
+            chan = &channel_table[inst->layout.table_idx[i]];
+            inst->downmix[o][i] = (inst->channels == 2) ? chan->stereo[o] : chan->quad[o];
+            sum += inst->downmix[o][i];
+        }
+
+        if (sum > 0) {
+            for (i = 0; i < inst->layout.channels; i++) {
+                inst->downmix[o][i] /= sum;
+            }
+        }
+    }
+}
+
+/* Open the output for the current rate and layout. The decoders are
+ * left alone, so this can be done in the middle of a burst.
+ */
+static void open_output(struct compressed_sink *inst)
+{
+    bool have_sink;
+    pa_sample_spec sink_ss;
+    pa_channel_map sink_map;
+    const pa_channel_map *channel_map;
+
+    static const pa_channel_map channel_map_2_0 = {
+        .channels = 2,
+        .map[0] = PA_CHANNEL_POSITION_FRONT_LEFT,
+        .map[1] = PA_CHANNEL_POSITION_FRONT_RIGHT,
+    };
+
+    static const pa_channel_map channel_map_4_0 = {
+        .channels = 4,
+        .map[0] = PA_CHANNEL_POSITION_FRONT_LEFT,
+        .map[1] = PA_CHANNEL_POSITION_FRONT_RIGHT,
+        .map[2] = PA_CHANNEL_POSITION_REAR_LEFT,
+        .map[3] = PA_CHANNEL_POSITION_REAR_RIGHT,
+    };
+
+    /* Look at the sink first, so that the output can be set up to match it. */
+    have_sink = (pa_output_connect(&inst->core.output) == 0) &&
+                (pa_output_get_sink_spec(&inst->core.output, &sink_ss, &sink_map) == 0);
+
+    inst->channels = have_sink ? output_channels(inst, &sink_map) : inst->layout.channels;
+    if (inst->channels != inst->layout.channels) {
+        printf("61937: Downmixing %u channels to %u for the sink\n", inst->layout.channels, inst->channels);
+        init_downmix(inst);
+    }
+
+    if (inst->channels == inst->layout.channels) {
+        channel_map = &inst->layout.map;
+    } else if (inst->channels == 2) {
+        channel_map = &channel_map_2_0;
+    } else {
+        channel_map = &channel_map_4_0;
+    }
+
+    /* The core sets the loop up for the default frame size. */
+    inst->frame_size = COMPRESSED_SINK_FRAME_SIZE;
+
+    sink_core_open(&inst->core,
+                   inst->latency_us,
+                   inst->rate,
+                   have_sink ? sink_ss.rate : 0,
+                   inst->channels,
+                   channel_map);
+}
+
+/* Open the compressed sink. */
+void compressed_sink_open(struct compressed_sink *inst, uint32_t latency_us)
+{
+    inst->latency_us = latency_us;
+
+    /* Start from a clean slate, since whatever was left over from the
+     * last stream has nothing to do with this one.
+     */
+    flush_decoders(inst);
+    inst->in_pause = false;
+    inst->silence_frames = 0;
+    inst->silence_lead = 0;
+    inst->gap_rem = 0;
+    inst->elapsed_rem = 0;
+
+    open_output(inst);
+}
+
+/* Close the compressed sink. The decoder and rate converter are kept
+ * around for the next open.
+ */
+void compressed_sink_close(struct compressed_sink *inst)
+{
+    sink_core_close(&inst->core);
+}
+
+/* Free everything that was set up by compressed_sink_init(). */
+void compressed_sink_free(struct compressed_sink *inst)
+{
+    uint32_t i;
+
+    sink_core_free(&inst->core);
+
+    for (i = 0; i < COMPRESSED_SINK_NR_DECODERS; i++) {
+        if (inst->decoders[i].cctx) {
+            avcodec_close(inst->decoders[i].cctx);
+            avcodec_free_context(&inst->decoders[i].cctx);
+        }
+    }
+    av_frame_free(&inst->frame);
+}
+
+/* Get a snapshot of the sink statistics. */
+void compressed_sink_get_stats(struct compressed_sink *inst, struct compressed_sink_stats *stats)
+{
+    sink_core_get_stats(&inst->core, &stats->core);
+
+    /* Only touched by the processing thread. */
+    stats->pauses = inst->pauses;
+    stats->pause_frames = inst->pause_frames;
+}
+
+/* Synthesize nr_frames of silence. It's queued in pieces no bigger than
+ * the current format's frames so that the control loop sees the same
+ * update rate as it does with real frames.
+ */
+static void queue_silence(struct compressed_sink *inst, uint32_t nr_frames)
+{
+    uint32_t n;
+    uint64_t cpu_start;
+
+    while (nr_frames) {
+        cpu_start = sink_core_thread_cpu_ns();
+
+        n = nr_frames;
+        if (n > inst->frame_size) {
+            n = inst->frame_size;
+        }
+
+        memset(inst->tmp_input_buf, 0, n * inst->channels * sizeof(float));
+        sink_core_queue(&inst->core, inst->tmp_input_buf, n, cpu_start);
+
+        nr_frames -= n;
+    }
+}
+
+/* Queue the silence that's owed for a gap, but never more than one
+ * frame ahead of the captured input, just like a real frame would be.
+ * Anything more would only sit in the buffer above the target.
+ */
+static void queue_owed_silence(struct compressed_sink *inst)
+{
+    uint32_t n;
+
+    while (inst->silence_frames && (inst->silence_lead <= 0)) {
+        n = inst->silence_frames;
+        if (n > inst->frame_size) {
+            n = inst->frame_size;
+        }
+
+        queue_silence(inst, n);
+
+        inst->silence_frames -= n;
+        inst->silence_lead += n;
+    }
+}
+
+/* Convert transport frames to decoded frames, keeping track of the
+ * fractional part in *rem.
+ */
+static uint32_t transport_to_decoded(struct compressed_sink *inst,
+                                     uint32_t nr_frames,
+                                     uint32_t transport_rate,
+                                     uint64_t *rem)
+{
+    const uint64_t total = ((uint64_t)nr_frames * inst->rate) + *rem;
+
+    *rem = total % transport_rate;
+
+    return total / transport_rate;
+}
+
+/* Returns sample i of channel ch of a decoded frame that isn't planar float. */
+static float frame_sample(AVFrame *frame, int ch, size_t i)
+{
+    switch (frame->format) {
+    case AV_SAMPLE_FMT_S32P:
+        return ((int32_t *)frame->data[ch])[i] * (1.0f / (1u << 31u));
+    case AV_SAMPLE_FMT_S16P:
+        return ((int16_t *)frame->data[ch])[i] * (1.0f / (1u << 15u));
+    case AV_SAMPLE_FMT_S32:
+        return ((int32_t *)frame->data[0])[(i * frame->channels) + ch] * (1.0f / (1u << 31u));
+    case AV_SAMPLE_FMT_S16:
+        return ((int16_t *)frame->data[0])[(i * frame->channels) + ch] * (1.0f / (1u << 15u));
+    default:
+        return 0;
+    }
+}
+
+/* Decode a single packet and queue the result. */
+static void decode_packet(struct compressed_sink *inst, AVCodecContext *cctx, uint8_t *data, size_t len)
+{
+    size_t i;
+    int error;
+#ifdef FFMPEG_OLD_AUDIO_API
+    int got_one;
+#endif
+    uint32_t ch;
+    uint64_t mask;
+    uint64_t cpu_start;
+    float *in;
+    struct compressed_sink_layout layout;
+    char old_desc[PA_CHANNEL_MAP_SNPRINT_MAX];
+    char new_desc[PA_CHANNEL_MAP_SNPRINT_MAX];
+
+    cpu_start = sink_core_thread_cpu_ns();
+
+    inst->packet->data = data;
+    inst->packet->size = len;
+
+#ifdef FFMPEG_OLD_AUDIO_API
+    error = avcodec_decode_audio4(cctx, inst->frame, &got_one, inst->packet);
+    if (error < 0) {
+        printf("Error decoding frame\n");
+        return;
+    }
+
+    if (!got_one) {
+        printf("No frame was decoded\n");
+        return;
+    }
+#else
+    /* Submit. */
+    error = avcodec_send_packet(cctx, inst->packet);
+    if (error == AVERROR(EAGAIN)) {
+        /* From the doc: Input is not accepted in the current state - user
+         * must read output with avcodec_receive_frame().
+         */
+        printf("avcodec_send_packet returned EAGAIN - discarding frames...\n");
+        while (!avcodec_receive_frame(cctx, inst->frame)) {
+            /* Just drop all frames until the decoder is ready to accept new input.
+             * We will pick back up on the next frame.
+             */
+        }
+        return;
+    } else if (error < 0) {
+        /* Decoding failed. */
+        printf("Error decoding frame\n");
+        return;
+    }
+
+    /* Pull out the decoded frame. */
+    error = avcodec_receive_frame(cctx, inst->frame);
+    if (error) {
+        printf("No frame was decoded\n");
+        return;
+    }
+#endif
+
+    if ((inst->frame->format != AV_SAMPLE_FMT_FLTP) &&
+        (inst->frame->format != AV_SAMPLE_FMT_S32P) &&
+        (inst->frame->format != AV_SAMPLE_FMT_S16P) &&
+        (inst->frame->format != AV_SAMPLE_FMT_S32) &&
+        (inst->frame->format != AV_SAMPLE_FMT_S16)) {
+        /* Most of the decoders output planar float, but the lossless
+         * ones (TrueHD and DTS-HD MA) output integers.
+         */
+        printf("Unsupported decoded sample format %d\n", inst->frame->format);
+        return;
+    }
+
+    mask = frame_layout(inst->frame);
+
+    if (((uint32_t)inst->frame->sample_rate != inst->rate) || (mask != inst->layout.mask)) {
+        if (!init_layout(&layout, mask)) {
+            if ((mask != inst->rejected_mask) || (inst->frame->channels != inst->rejected_channels)) {
+                printf("Unsupported channel layout (channels = %d, layout = 0x%llx)\n",
+                       inst->frame->channels,
+                       (unsigned long long)mask);
+                inst->rejected_mask = mask;
+                inst->rejected_channels = inst->frame->channels;
+            }
+            return;
+        }
+        inst->rejected_mask = 0;
+        inst->rejected_channels = 0;
+
+        /* The drift compensation can't make up for anything more than
+         * a slight mismatch, so reopen the output to set the rate
+         * conversion up for the decoded rate (DTS-CD and some MPEG
+         * streams are 44.1 kHz, for example). Same thing when the
+         * channel layout changes (like an AC3 stream going from 2/0
+         * to 3/2 at the end of an ad break), since the stream has to
+         * be opened with the new channel map. The layout is kept
+         * across opens, so this only happens on an actual change.
+         * Only the output is reopened. The decoders keep their state,
+         * since the rest of the burst (more TrueHD access units or
+         * E-AC3 syncframes) still depends on it.
+         */
+        pa_channel_map_snprint(old_desc, sizeof(old_desc), &inst->layout.map);
+        pa_channel_map_snprint(new_desc, sizeof(new_desc), &layout.map);
+        printf("Decoded format changed from %u Hz/%s to %d Hz/%s; reopening output\n",
+               inst->rate,
+               old_desc,
+               inst->frame->sample_rate,
+               new_desc);
+        sink_core_close(&inst->core);
+        inst->rate = inst->frame->sample_rate;
+        inst->layout = layout;
+        open_output(inst);
+    }
+
+    if (inst->frame->nb_samples > (sizeof(inst->tmp_input_buf) / sizeof(float) / inst->layout.channels)) {
+        printf("Decoded frame too large (%d samples)\n", inst->frame->nb_samples);
+        return;
+    }
+
+    if ((uint32_t)inst->frame->nb_samples != inst->frame_size) {
+        /* Different format. Retune the loop for the new frame size. */
+        sink_core_init_loop(&inst->core, loop_hist_size(inst->frame->nb_samples));
+        inst->frame_size = inst->frame->nb_samples;
+    }
+
+    /* Interleave the decoded planes. They're already in the order of
+     * the layout's channel map.
+     */
+    if (inst->frame->format == AV_SAMPLE_FMT_FLTP) {
+        inst->layout.interleave(inst->tmp_input_buf, inst->frame);
+    } else {
+        /* Lossless formats. */
+        in = inst->tmp_input_buf;
+        for (i = 0; i < (size_t)inst->frame->nb_samples; i++) {
+            for (ch = 0; ch < inst->layout.channels; ch++) {
+                /* Mono goes to both fronts. */
+                *in++ = frame_sample(inst->frame, (ch < (uint32_t)inst->frame->channels) ? ch : 0, i);
+            }
+        }
+    }
+
+    if (inst->channels != inst->layout.channels) {
+        inst->downmix_kernel(inst->tmp_input_buf,
+                             (const float (*)[COMPRESSED_SINK_MAX_CHANNELS])inst->downmix,
+                             inst->frame->nb_samples);
+    }
+
+    sink_core_queue(&inst->core, inst->tmp_input_buf, inst->frame->nb_samples, cpu_start);
+}
+
+/* Returns the length of the E-AC3 syncframe at data, or 0 if there
+ * isn't a valid one there. If it's valid, *strmtyp and *substreamid
+ * are set from the header.
+ */
+static size_t eac3_frame_len(const uint8_t *data, size_t len, uint8_t *strmtyp, uint8_t *substreamid)
+{
+    size_t frame_len;
+
+    if ((len < 4u) || (data[0] != 0x0B) || (data[1] != 0x77)) {
+        return 0;
+    }
+
+    *strmtyp = data[2] >> 6u;
+    *substreamid = (data[2] >> 3u) & 0x7;
+    frame_len = ((((size_t)data[2] & 0x7) << 8u) | data[3]) + 1u;
+    frame_len *= 2u;
+
+    if (frame_len > len) {
+        return 0;
+    }
+
+    return frame_len;
+}
+
+/* An E-AC3 burst holds several syncframes. Each independent frame is
+ * decoded together with the dependent frames that follow it (which
+ * carry the extra channels for 7.1 and so on), since that's how the
+ * decoder wants them. Only the first program (substream 0) is played.
+ */
+static void decode_eac3(struct compressed_sink *inst,
+                        const struct compressed_sink_format *format,
+                        uint8_t *data,
+                        size_t len)
+{
+    size_t pos;
+    size_t start;
+    size_t frame_len;
+    uint8_t strmtyp;
+    uint8_t substreamid;
+    bool play;
+    AVCodecContext *cctx = inst->decoders[format->decoder].cctx;
+
+    pos = 0;
+    while (pos < len) {
+        frame_len = eac3_frame_len(&data[pos], len - pos, &strmtyp, &substreamid);
+        if (!frame_len || (strmtyp == COMPRESSED_SINK_EAC3_DEPENDENT)) {
+            printf("Bad E-AC3 burst\n");
+            return;
+        }
+
+        start = pos;
+        play = (substreamid == 0);
+        pos += frame_len;
+
+        /* Pick up the dependent frames. */
+        while (pos < len) {
+            frame_len = eac3_frame_len(&data[pos], len - pos, &strmtyp, &substreamid);
+            if (!frame_len || (strmtyp != COMPRESSED_SINK_EAC3_DEPENDENT)) {
+                break;
+            }
+            pos += frame_len;
+        }
+
+        if (play) {
+            decode_packet(inst, cctx, &data[start], pos - start);
+        }
+
+        if ((pos < len) && !frame_len) {
+            /* Whatever is left is the padding at the end of the burst. */
+            return;
+        }
+    }
+}
+
+/* Decode a burst that holds a single packet. */
+static void decode_single(struct compressed_sink *inst,
+                          const struct compressed_sink_format *format,
+                          uint8_t *data,
+                          size_t len)
+{
+    decode_packet(inst, inst->decoders[format->decoder].cctx, data, len);
+}
+
+/* MPEG audio bursts don't say which layer they are for all data types,
+ * so look at the frame header. libavcodec has a decoder per layer.
+ */
+static void decode_mpeg(struct compressed_sink *inst,
+                        const struct compressed_sink_format *format,
+                        uint8_t *data,
+                        size_t len)
+{
+    enum compressed_sink_decoder_idx decoder;
+
+    if ((len < 4u) || (data[0] != 0xFF) || ((data[1] & 0xE0) != 0xE0)) {
+        printf("Bad MPEG audio burst\n");
+        return;
+    }
+
+    switch ((data[1] >> 1u) & 0x3) {
+    case 3:
+        decoder = COMPRESSED_SINK_DECODER_MP1;
+        break;
+    case 2:
+        decoder = COMPRESSED_SINK_DECODER_MP2;
+        break;
+    case 1:
+        decoder = COMPRESSED_SINK_DECODER_MP3;
+        break;
+    default:
+        printf("Bad MPEG audio layer\n");
+        return;
+    }
+
+    decode_packet(inst, inst->decoders[decoder].cctx, data, len);
+}
+
+/* MAT frames are TrueHD data with a few fixed codes mixed in. */
+static const uint8_t mat_start_code[] = {
+    0x07, 0x9E, 0x00, 0x03, 0x84, 0x01, 0x01, 0x01, 0x80, 0x00,
+    0x56, 0xA5, 0x3B, 0xF4, 0x81, 0x83, 0x49, 0x80, 0x77, 0xE0,
+};
+static const uint8_t mat_middle_code[] = {
+    0xC3, 0xC1, 0x42, 0x49, 0x3B, 0xFA, 0x82, 0x83, 0x49, 0x80, 0x77, 0xE0,
+};
+static const uint8_t mat_end_code[] = {
+    0xC3, 0xC2, 0xC0, 0xC4, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x97, 0x11,
+};
+
+/* Returns the offset of the MAT middle code, or 0 if it isn't there. */
+static size_t find_mat_middle_code(const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for (i = sizeof(mat_start_code); (i + sizeof(mat_middle_code)) <= len; i++) {
+        if ((data[i] == mat_middle_code[0]) &&
+            !memcmp(&data[i], mat_middle_code, sizeof(mat_middle_code))) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+/* A MAT burst holds 24 TrueHD access units (20 ms at 48 kHz) spaced
+ * out with padding, and with the MAT codes at the start, in the middle,
+ * and at the end. The codes are stripped out first (an access unit can
+ * be split by the middle one), and then each access unit is decoded on
+ * its own, using the length in its header.
+ */
+static void decode_mat(struct compressed_sink *inst,
+                       const struct compressed_sink_format *format,
+                       uint8_t *data,
+                       size_t len)
+{
+    size_t pos;
+    size_t mid;
+    size_t hd_len;
+    size_t au_len;
+    AVCodecContext *cctx = inst->decoders[format->decoder].cctx;
+
+    if ((len < (sizeof(mat_start_code) + sizeof(mat_middle_code) + sizeof(mat_end_code))) ||
+        memcmp(data, mat_start_code, sizeof(mat_start_code)) ||
+        memcmp(&data[len - sizeof(mat_end_code)], mat_end_code, sizeof(mat_end_code))) {
+        printf("Bad MAT burst\n");
+        return;
+    }
+
+    /* The payload (everything but the codes) has to fit in hd_buf. */
+    if ((len - sizeof(mat_start_code) - sizeof(mat_middle_code) - sizeof(mat_end_code)) > sizeof(inst->hd_buf)) {
+        printf("MAT burst too large (%zu)\n", len);
+        return;
+    }
+
+    mid = find_mat_middle_code(data, len - sizeof(mat_end_code));
+    if (!mid) {
+        printf("MAT middle code missing\n");
+        return;
+    }
+
+    hd_len = mid - sizeof(mat_start_code);
+    memcpy(inst->hd_buf, &data[sizeof(mat_start_code)], hd_len);
+    memcpy(&inst->hd_buf[hd_len],
+           &data[mid + sizeof(mat_middle_code)],
+           len - sizeof(mat_end_code) - mid - sizeof(mat_middle_code));
+    hd_len += len - sizeof(mat_end_code) - mid - sizeof(mat_middle_code);
+
+    pos = 0;
+    while ((pos + 4u) <= hd_len) {
+        if (!inst->hd_buf[pos] && !inst->hd_buf[pos + 1u]) {
+            /* Padding. */
+            pos += 2u;
+            continue;
+        }
+
+        /* Check nibble, then the length in 16 bit words. */
+        au_len = ((((size_t)inst->hd_buf[pos] & 0x0F) << 8u) | inst->hd_buf[pos + 1u]) * 2u;
+        if ((au_len < 4u) || ((pos + au_len) > hd_len)) {
+            printf("Bad TrueHD access unit\n");
+            return;
+        }
+
+        decode_packet(inst, cctx, &inst->hd_buf[pos], au_len);
+        pos += au_len;
+    }
+}
+
+/* DTS-HD bursts start with a header that ends with the length of the
+ * DTS-HD frame (core and extensions) that follows it.
+ */
+static void decode_dtshd(struct compressed_sink *inst,
+                         const struct compressed_sink_format *format,
+                         uint8_t *data,
+                         size_t len)
+{
+    size_t frame_len;
+    static const uint8_t start_code[] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFE, 0xFE,
+    };
+
+    if ((len < (sizeof(start_code) + 2u)) || memcmp(data, start_code, sizeof(start_code))) {
+        printf("Bad DTS-HD burst\n");
+        return;
+    }
+
+    frame_len = ((size_t)data[sizeof(start_code)] << 8u) | data[sizeof(start_code) + 1u];
+    if ((sizeof(start_code) + 2u + frame_len) > len) {
+        printf("Bad DTS-HD frame length (%zu)\n", frame_len);
+        return;
+    }
+
+    decode_packet(inst, inst->decoders[format->decoder].cctx, &data[sizeof(start_code) + 2u], frame_len);
+}
+
+/* Everything that the sink can decode, keyed by IEC 61937 data type. */
+static const struct compressed_sink_format formats[] = {
+    { IEC_61937_DATA_TYPE_AC3,          COMPRESSED_SINK_DECODER_AC3,    decode_single },
+    { IEC_61937_DATA_TYPE_EAC3,         COMPRESSED_SINK_DECODER_EAC3,   decode_eac3   },
+    { IEC_61937_DATA_TYPE_DTS1,         COMPRESSED_SINK_DECODER_DTS,    decode_single },
+    { IEC_61937_DATA_TYPE_DTS2,         COMPRESSED_SINK_DECODER_DTS,    decode_single },
+    { IEC_61937_DATA_TYPE_DTS3,         COMPRESSED_SINK_DECODER_DTS,    decode_single },
+    { IEC_61937_DATA_TYPE_DTSHD,        COMPRESSED_SINK_DECODER_DTS,    decode_dtshd  },
+    { IEC_61937_DATA_TYPE_MAT,          COMPRESSED_SINK_DECODER_TRUEHD, decode_mat    },
+    { IEC_61937_DATA_TYPE_MPEG1_L1,     COMPRESSED_SINK_DECODER_MP1,    decode_single },
+    { IEC_61937_DATA_TYPE_MPEG1_L23,    COMPRESSED_SINK_DECODER_MP2,    decode_mpeg   },
+    { IEC_61937_DATA_TYPE_MPEG2_EXT,    COMPRESSED_SINK_DECODER_MP2,    decode_mpeg   },
+    { IEC_61937_DATA_TYPE_MPEG2_AAC,    COMPRESSED_SINK_DECODER_AAC,    decode_single },
+    { IEC_61937_DATA_TYPE_MPEG2_L1_LSF, COMPRESSED_SINK_DECODER_MP1,    decode_single },
+    { IEC_61937_DATA_TYPE_MPEG2_L2_LSF, COMPRESSED_SINK_DECODER_MP2,    decode_mpeg   },
+    { IEC_61937_DATA_TYPE_MPEG2_L3_LSF, COMPRESSED_SINK_DECODER_MP3,    decode_mpeg   },
+};
+
+/* Returns the format for the given data type, or NULL if it can't be decoded. */
+static const struct compressed_sink_format *lookup_format(uint16_t data_type)
+{
+    size_t i;
+
+    for (i = 0; i < (sizeof(formats) / sizeof(formats[0])); i++) {
+        if (formats[i].data_type == data_type) {
+            return &formats[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns true if bursts of the given type can be decoded. */
+bool compressed_sink_supports(uint16_t data_type)
+{
+    return (lookup_format(data_type) != NULL);
+}
+
+/* Send a data burst payload to the sink. */
+void compressed_sink_process(struct compressed_sink *inst, uint16_t data_type, uint8_t *data, size_t len)
+{
+    const struct compressed_sink_format *format = lookup_format(data_type);
+
+    if (!format) {
+        printf("Unsupported data type 0x%x\n", data_type);
+        return;
+    }
+
+    inst->in_pause = false;
+
+    /* The stream is back, so whatever is left of the gap goes in ahead
+     * of it. That's normally less than a chunk's worth, but if the
+     * stream came back early, the rest would only add latency.
+     */
+    if (inst->silence_frames > inst->frame_size) {
+        inst->silence_frames = inst->frame_size;
+    }
+    queue_silence(inst, inst->silence_frames);
+    inst->silence_frames = 0;
+    inst->silence_lead = 0;
+
+    format->decode(inst, format, data, len);
+}
+
+/* Play silence for a pause (or gap) in the stream. */
+void compressed_sink_pause(struct compressed_sink *inst, uint32_t nr_frames, uint32_t transport_rate)
+{
+    uint32_t frames;
+
+    if (!inst->in_pause) {
+        /* Start of a gap. Don't let the end of the last frame bleed
+         * into the first one after it.
+         */
+        flush_decoders(inst);
+        inst->in_pause = true;
+        inst->pauses++;
+        inst->silence_lead = 0;
+        inst->elapsed_rem = 0;
+    }
+
+    /* The gap is in transport frames, which run faster than the
+     * decoded audio for high rate and HBR streams.
+     */
+    frames = transport_to_decoded(inst, nr_frames, transport_rate, &inst->gap_rem);
+    inst->pause_frames += frames;
+    inst->silence_frames += frames;
+
+    /* Start it off right away, so that the output isn't short until
+     * the next chunk is captured.
+     */
+    queue_owed_silence(inst);
+}
+
+/* Queue whatever silence became due while the chunk was captured. */
+void compressed_sink_advance(struct compressed_sink *inst, uint32_t nr_frames, uint32_t transport_rate)
+{
+    if (!inst->silence_frames) {
+        return;
+    }
+
+    inst->silence_lead -= transport_to_decoded(inst, nr_frames, transport_rate, &inst->elapsed_rem);
+    queue_owed_silence(inst);
+}
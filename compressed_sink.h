@@ -0,0 +1,188 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMPRESSED_SINK_H_
+#define _COMPRESSED_SINK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <libavcodec/avcodec.h>
+
+#include "config.h"
+#include "sink_core.h"
+#include "iec_61937.h"
+
+/* Up to 7.1. Smaller layouts are played as they are. */
+#define COMPRESSED_SINK_MAX_CHANNELS          8
+
+/* Stereo and quad sinks get a downmix (see output_channels()). */
+#define COMPRESSED_SINK_MAX_DOWNMIX_CHANNELS  4
+
+/* Size of the TrueHD data in a MAT frame, once the MAT codes are
+ * stripped out of it.
+ */
+#define COMPRESSED_SINK_MAT_FRAME_SIZE        61424u
+
+/* Number of frames (per channel) in a decoded AC3 frame. The loop
+ * window is tuned for frames of this size.
+ */
+#define COMPRESSED_SINK_FRAME_SIZE            1536u
+
+/* E-AC3 stream type of a dependent substream frame. */
+#define COMPRESSED_SINK_EAC3_DEPENDENT        1u
+
+enum compressed_sink_decoder_idx {
+    COMPRESSED_SINK_DECODER_AC3,
+    COMPRESSED_SINK_DECODER_EAC3,
+    COMPRESSED_SINK_DECODER_DTS,
+    COMPRESSED_SINK_DECODER_MP1,
+    COMPRESSED_SINK_DECODER_MP2,
+    COMPRESSED_SINK_DECODER_MP3,
+    COMPRESSED_SINK_DECODER_AAC,
+    COMPRESSED_SINK_DECODER_TRUEHD,
+    COMPRESSED_SINK_NR_DECODERS
+};
+
+struct compressed_sink_decoder {
+    const AVCodec *codec;
+    AVCodecContext *cctx;
+};
+
+/* Layout of the decoded audio. The decoders put the channels out in
+ * libavcodec's order (which is the order of the AV_CH_* bits), so the
+ * planes are just interleaved in that order, and the stream is opened
+ * with a channel map that says where each of them goes.
+ */
+struct compressed_sink_layout {
+    /* AV_CH_* mask of the decoded channels. */
+    uint64_t mask;
+    /* Number of interleaved channels. Mono is played as stereo. */
+    uint32_t channels;
+    pa_channel_map map;
+    /* Entry in the channel table for each interleaved channel. */
+    uint8_t table_idx[COMPRESSED_SINK_MAX_CHANNELS];
+    /* Interleaves a planar float frame for this layout. */
+    void (*interleave)(float *out, const AVFrame *frame);
+};
+
+struct compressed_sink_stats {
+    struct sink_core_stats core;
+    /* Pauses in the stream and frames of silence played for them. */
+    uint32_t pauses;
+    uint32_t pause_frames;
+};
+
+struct compressed_sink {
+    struct sink_core core;
+
+    /* The ring buffer holds COMPRESSED_SINK_SAMPLE_BUFFER_SIZE samples.
+     * The output of the drift compensation needs to be large enough to
+     * store an entire decoded frame worth of samples _after_ resampling.
+     * Frames are up to 2048 samples, and the output can be at the sink's
+     * rate, so leave room for something like 44.1k in and 192k out.
+     */
+    SINK_CORE_STORAGE(COMPRESSED_SINK_SAMPLE_BUFFER_SIZE,
+                      COMPRESSED_SINK_OUTPUT_CHUNK_SIZE,
+                      COMPRESSED_SINK_MAX_CHANNELS * 10240,
+                      COMPRESSED_SINK_MAX_CHANNELS * 10240) storage;
+
+    /* Decoded frame, interleaved in the sink channel order. */
+    float tmp_input_buf[COMPRESSED_SINK_MAX_CHANNELS * 2048];
+
+    struct compressed_sink_decoder decoders[COMPRESSED_SINK_NR_DECODERS];
+    AVPacket *packet;
+    AVFrame *frame;
+
+    /* TrueHD data pulled out of a MAT frame. */
+    uint8_t hd_buf[COMPRESSED_SINK_MAT_FRAME_SIZE];
+
+    /* Size of the decoded frames that the loop is tuned for. */
+    uint32_t frame_size;
+
+    /* Set while the stream is paused. */
+    bool in_pause;
+    uint32_t pauses;
+    uint32_t pause_frames;
+    /* Silence still owed for the current gap, and how far the silence
+     * that was queued is ahead of the input that has been captured
+     * since the gap started (both in decoded frames). The remainders
+     * carry the fractional frames left over from converting transport
+     * frames into decoded ones.
+     */
+    uint32_t silence_frames;
+    int64_t silence_lead;
+    uint64_t gap_rem;
+    uint64_t elapsed_rem;
+
+    /* Sampling rate and channel layout of the decoded audio. */
+    uint32_t rate;
+    struct compressed_sink_layout layout;
+    /* Last layout that couldn't be played, so that it's only reported
+     * once for as long as it keeps showing up.
+     */
+    uint64_t rejected_mask;
+    int rejected_channels;
+    /* Channel count of everything after the decoder. This is less
+     * than layout.channels when the sink doesn't have all of them, in
+     * which case the decoded audio goes through the downmix matrix
+     * (indexed [output][decoded channel]) first, using the kernel for
+     * that pair of channel counts.
+     */
+    uint32_t channels;
+    float downmix[COMPRESSED_SINK_MAX_DOWNMIX_CHANNELS][COMPRESSED_SINK_MAX_CHANNELS];
+    void (*downmix_kernel)(float *buf,
+                           const float (*gains)[COMPRESSED_SINK_MAX_CHANNELS],
+                           size_t nr_frames);
+    uint32_t latency_us;
+};
+
+/* Set up the decoder and rate converter ahead of time. Must be
+ * called once before the first open.
+ */
+void compressed_sink_init(struct compressed_sink *inst);
+
+void compressed_sink_open(struct compressed_sink *inst, uint32_t latency_us);
+
+void compressed_sink_close(struct compressed_sink *inst);
+
+void compressed_sink_free(struct compressed_sink *inst);
+
+void compressed_sink_get_stats(struct compressed_sink *inst, struct compressed_sink_stats *stats);
+
+/* Returns true if bursts of the given IEC 61937 data type can be decoded. */
+bool compressed_sink_supports(uint16_t data_type);
+
+/* Data is a pointer to the payload of an IEC 61937 data burst of the
+ * given type.
+ */
+void compressed_sink_process(struct compressed_sink *inst, uint16_t data_type, uint8_t *data, size_t len);
+
+/* Play silence in place of the stream for a pause burst with a gap
+ * of nr_frames transport frames (IEC 60958 frames, at transport_rate).
+ * The silence is queued as the gap goes by (see
+ * compressed_sink_advance()), so that the level stays at the target.
+ */
+void compressed_sink_pause(struct compressed_sink *inst, uint32_t nr_frames, uint32_t transport_rate);
+
+/* Let the sink know that nr_frames transport frames were captured, so
+ * that it can queue the silence that's due for a gap.
+ */
+void compressed_sink_advance(struct compressed_sink *inst, uint32_t nr_frames, uint32_t transport_rate);
+
+
+#endif /* _COMPRESSED_SINK_H_ */
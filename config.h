@@ -35,15 +35,180 @@
  */
 #undef USE_AC3_SURROUND_MAPPING
 
+/* Sampling rate of the S/PDIF input. E-AC3 is carried in a 192 kHz
+ * IEC 60958 stream (four times the rate of the decoded audio), so this
+ * needs to be 192000 to receive it. PCM is played back at this rate,
+ * unless RATE_DETECT finds that the input is really running at
+ * another one.
+ */
+#define INPUT_SAMPLE_RATE              48000u
+
+/* Input sample rate detection. S/PDIF receivers tend to follow the
+ * rate of whatever is plugged into them, so when the source switches
+ * rates, the capture stream keeps claiming INPUT_SAMPLE_RATE while the
+ * frames actually show up at the new rate. When defined, the rate that
+ * frames arrive at is measured over RATE_DETECT_WINDOW_MS windows, and
+ * if RATE_DETECT_CONFIRM_WINDOWS in a row come out within
+ * RATE_DETECT_TOLERANCE_PERCENT of a different standard rate (32 kHz
+ * up to 192 kHz), PCM is played back at that rate from then on.
+ * Windows that don't match any standard rate (stalls, backlogs) are
+ * just ignored.
+ */
+#define RATE_DETECT                    1
+#define RATE_DETECT_WINDOW_MS          100u
+#define RATE_DETECT_CONFIRM_WINDOWS    2u
+#define RATE_DETECT_TOLERANCE_PERCENT  2
+
+/* Number of channels captured from the input (2, 6 or 8). S/PDIF is
+ * always 2, but HDMI capture devices can deliver 5.1 or 7.1 LPCM, which
+ * is played back with all of its channels (in the usual FL, FR, FC, LFE,
+ * RL, RR, SL, SR order). INPUT_CHUNK_SIZE must hold a whole number of
+ * frames, so with 6 channels, use something like 384 or 1536.
+ * IEC 61937 bursts are normally only looked for in the first pair, since
+ * that's where a regular (2 channel) bitstream ends up.
+ */
+#define INPUT_CHANNELS                 2u
+
+/* HDMI sends TrueHD and DTS-HD MA as a high bit rate (HBR) stream,
+ * which shows up as 8 channels at 192 kHz, with a single IEC 61937
+ * stream spread across all of them. To receive that, define this, set
+ * INPUT_CHANNELS to 8, INPUT_SAMPLE_RATE to 192000, and INPUT_CHUNK_SIZE
+ * to something like 4096 so that the chunks don't get too short.
+ */
+/* #define INPUT_HBR                      1 */
+
 /* Input data is read out in chunks of this size (in bytes). */
 #define INPUT_CHUNK_SIZE               512u /* 2.6 millisecond chunks */
 
+/* Size of each captured sample, in bytes. S/PDIF is normally captured
+ * as 16 bit (2). SMPTE 337M feeds on AES3 can send their bursts in 20
+ * or 24 bit words, which need a 32 bit capture (4) to get through.
+ */
+#define INPUT_SAMPLE_BYTES             2u
+
 /* Number of input chunks that must pass without receiving a single
  * IEC 61937 data burst before considering the input to be a PCM
  * stream.
  */
 #define IEC_61937_DETECTION_WINDOW     64u
 
+/* Data bursts of a given type (AC3, for example) show up at a fixed
+ * repetition period (1536 frames for AC3), so once one has been seen,
+ * it's known exactly where the next one should start. If it doesn't
+ * show up within IEC_61937_PERIOD_TOLERANCE frames of that point, it's
+ * counted as missed, and after IEC_61937_MAX_MISSED_PERIODS in a row,
+ * the input is considered to be PCM again. This is a lot quicker than
+ * waiting for IEC_61937_DETECTION_WINDOW, which is still used for
+ * data types with an unknown period.
+ * While the period is known, the stuffing between the end of a burst
+ * and the next expected preamble isn't scanned at all.
+ */
+#define IEC_61937_PERIOD_TOLERANCE     16u
+#define IEC_61937_MAX_MISSED_PERIODS   2u
+
+/* Also accept SMPTE 337M bursts (AC3 and Dolby E on broadcast AES3
+ * feeds). These have the same preamble as IEC 61937 but without the
+ * leading zero words, and can also be sent in 20 or 24 bit words
+ * (see INPUT_SAMPLE_BYTES). Since the zero words are no longer needed
+ * to find a burst, detection gets a little less strict for regular
+ * S/PDIF input too, so this is off by default.
+ */
+/* #define SMPTE_337M                     1 */
+
+/* Look for raw DTS (as found on DTS CDs and LDs) in the PCM input.
+ * This is just back to back DTS frames without any IEC 61937 framing,
+ * so it would otherwise be played as noise. Once found, it's handled
+ * just like IEC 61937 DTS. Note that DTS CDs are 44.1 kHz, so
+ * INPUT_SAMPLE_RATE has to be set to match.
+ * Comment out to disable.
+ */
+#define DTS_PCM_DETECTION              1
+
+/* Number of input chunks that PCM is delayed by before being played.
+ * IEC 61937 detection only happens once the burst preamble shows up,
+ * so without this, the chunks right before it (which are part of the
+ * new bitstream) get played as full scale noise. With the lookahead,
+ * those chunks are still in the delay line when the preamble is found
+ * and get dropped instead. Each chunk adds INPUT_CHUNK_SIZE / 4 frames
+ * (2.67 ms, with 16 bit samples) of latency to PCM. Set to 0 to disable.
+ */
+#define PCM_LOOKAHEAD_CHUNKS           2u
+
+/* Data bursts that complete while the stream is still being detected
+ * (i.e., before the AC3 sink is open) are queued and replayed into the
+ * sink once it's open, so that playback starts on the very first burst.
+ * Up to PENDING_BURSTS bursts of up to PENDING_BURST_MAX_SIZE bytes are
+ * kept, and if more show up, the oldest ones are dropped.
+ */
+#define PENDING_BURSTS                 4u
+#define PENDING_BURST_MAX_SIZE         61440u /* MAT (TrueHD) */
+
+/* Capture backlog catch-up.
+ * If the program gets descheduled for a while, the capture stream keeps
+ * going and the reads just return the stale backlog, which would then
+ * get played late. Every CAPTURE_BACKLOG_CHECK_CHUNKS, the capture
+ * latency is checked, and if it's above CAPTURE_BACKLOG_THRESHOLD_US,
+ * enough whole chunks (PCM) or whole data bursts (AC3) are dropped to
+ * get back down to CAPTURE_BACKLOG_TARGET_US.
+ */
+#define CAPTURE_BACKLOG_CHECK_CHUNKS   16u
+#define CAPTURE_BACKLOG_THRESHOLD_US   20000u
+#define CAPTURE_BACKLOG_TARGET_US      5000u
+
+/* Drift compensation method.
+ * DRIFT_COMP_SRC:    The sinks resample the audio themselves with
+ *                    libsamplerate, with the ratio set by the rate loop.
+ *                    This is the default.
+ * DRIFT_COMP_SERVER: The output streams are opened with
+ *                    PA_STREAM_VARIABLE_RATE and the ratio is applied by
+ *                    updating the stream sample rate, so the server's
+ *                    resampler absorbs the drift and src_process() is
+ *                    skipped entirely. This uses a lot less CPU on
+ *                    low-power hosts, but the quality depends on the
+ *                    server's resampler settings.
+ * DRIFT_COMP_SRC_PULL: The ring buffer holds samples at the input rate
+ *                    and the output thread pulls exactly the number of
+ *                    frames that it needs through libsamplerate's callback
+ *                    API, so the ratio is applied at the moment the samples
+ *                    are consumed instead of a whole chunk in advance.
+ *                    The ratio is the measured output rate divided by the
+ *                    measured input rate, with the rate loop only trimming
+ *                    out whatever level error is left.
+ * DRIFT_COMP_SLIP:   No resampling at all. The ratio from the rate loop is
+ *                    integrated into a phase error, and whenever that
+ *                    reaches a whole frame, a single frame is repeated or
+ *                    dropped at the quietest point in the chunk with a
+ *                    FRAME_SLIP_XFADE_FRAMES crossfade. Everything else is
+ *                    copied through untouched, so this costs about as much
+ *                    as a memcpy. Meant for embedded hosts that can't
+ *                    afford a sinc resampler.
+ * In server mode, rate updates are sent at most once every
+ * DRIFT_COMP_SERVER_MIN_UPDATE_MS, and only when the rounded rate
+ * (1 Hz resolution) changes.
+ * In the two SRC modes, the output streams are opened at the rate of
+ * the default sink, and the fixed conversion to it is folded into the
+ * drift ratio, so that every sample only gets resampled once. In the
+ * other modes, the streams run at the input rate and the server does
+ * any conversion that's needed.
+ * The mode can also be picked on the compiler command line (for
+ * example -DDRIFT_COMP_MODE=DRIFT_COMP_SERVER), which is how
+ * tools/sink_bench.c compares them.
+ */
+#define DRIFT_COMP_SRC                 0
+#define DRIFT_COMP_SERVER              1
+#define DRIFT_COMP_SRC_PULL            2
+#define DRIFT_COMP_SLIP                3
+#ifndef DRIFT_COMP_MODE
+#define DRIFT_COMP_MODE                DRIFT_COMP_SRC
+#endif
+#define DRIFT_COMP_SERVER_MIN_UPDATE_MS 100u
+#define FRAME_SLIP_XFADE_FRAMES        32u
+
+/* Number of channels played by the PCM sink. PCM always goes out
+ * with the same layout it was captured with.
+ */
+#define PCM_SINK_CHANNELS              INPUT_CHANNELS
+
 /* Buffer level measurement averaging depth.
  * This is used to smooth out some of the jitter that
  * occurs when the buffer utilization is measured.
@@ -58,8 +223,10 @@
  * (PCM_SINK_BUFFER_TARGET_SAMPLES * PCM_SINK_LOOP_GAIN) + 1.
  * This is kept low enough to limit the max ratio to something
  * that won't result in audible pitch changes.
+ * The levels are in samples, so this is scaled by the channel
+ * count (0.000002 for stereo).
  */
-#define PCM_SINK_LOOP_GAIN             0.000002
+#define PCM_SINK_LOOP_GAIN             (0.000004 / PCM_SINK_CHANNELS)
 
 /* Number of samples to aim to keep in the buffer right before
  * the next chunk is added (so, the minimim utilization).
@@ -68,23 +235,24 @@
  * may cause larger buffer depletions to not be accounted for.
  * In other words, if your jitter is +- 64 samples, then this
  * should at least be 128.
+ * When RATE_LOOP_ADAPTIVE_TARGET is defined, this is only the
+ * starting point and the target follows the measured jitter.
  */
-#define PCM_SINK_BUFFER_TARGET_SAMPLES     128
+#define PCM_SINK_BUFFER_TARGET_SAMPLES     (64 * PCM_SINK_CHANNELS)
 
 /* PCM sink ring buffer size. Large enough to handle some
  * backups, but not so large that it takes forever to each
- * the target utilization level.
+ * the target utilization level. Must be a power of 2.
  */
-#define PCM_SINK_SAMPLE_BUFFER_SIZE        2048u
-#define PCM_SINK_SAMPLE_BUFFER_SIZE_MASK   (PCM_SINK_SAMPLE_BUFFER_SIZE - 1u)
+#define PCM_SINK_SAMPLE_BUFFER_SIZE        ((PCM_SINK_CHANNELS > 2u) ? 8192u : 2048u)
 
 /* Minimum amount of samples that we will attempt to write
  * to the PCM sink output stream. Note that this is SAMPLES
  * and not L/R frames or bytes.
- * NOTE: This must be a multiple of 2 otherwise the Pulseaudio
- *       sink can become out of sync w.r.t left/right.
+ * NOTE: This must be a multiple of the channel count otherwise
+ *       the Pulseaudio sink can become out of sync w.r.t left/right.
  */
-#define PCM_SINK_OUTPUT_CHUNK_SIZE     32u
+#define PCM_SINK_OUTPUT_CHUNK_SIZE     (16u * PCM_SINK_CHANNELS)
 
 /* PCM sink Pulseaudio output buffer. This directly impacts
  * the overall latency, so keep it small, but not so small
@@ -93,36 +261,169 @@
  * to maintain a buffer level, systems with high scheduling
  * jitter can still underrun/overflow the buffer.
  */
-#define PCM_SINK_PA_BUFFER_SIZE        2048u /* 5.3 milliseconds */
+#define PCM_SINK_PA_BUFFER_SIZE        (1024u * PCM_SINK_CHANNELS) /* 5.3 milliseconds */
 
 /* See comment above about the PCM sink. Note that this is
  * 6 times larger than the PCM value divided by two.
  * For the PCM sink we write 16 samples per channel, so 32 total,
  * so here we write 96.
  */
-#define AC3_SINK_OUTPUT_CHUNK_SIZE     96u
+#define COMPRESSED_SINK_OUTPUT_CHUNK_SIZE       96u
 
 /* Same as PCM sink, but adjusted for 6 channels. */
-#define AC3_SINK_PA_BUFFER_SIZE        6144u
+#define COMPRESSED_SINK_PA_BUFFER_SIZE          6144u
 
 /* See comment above regarding PCM. Note that this is
  * much smaller because AC3 frames arrive at a much lower
  * rate than PCM chunks, so in order to keep the loop
  * characteristics similar, this had to be reduced.
  */
-#define AC3_SINK_BUFFER_HIST_SIZE      128u
+#define COMPRESSED_SINK_BUFFER_HIST_SIZE        128u
 
 /* This is just like the PCM sink, but scaled to compensate
  * for 6 channels worth of samples.
  */
-#define AC3_SINK_LOOP_GAIN             0.0000006666666666666
+#define COMPRESSED_SINK_LOOP_GAIN               0.0000006666666666666
 
 /* See PCM comments above. */
-#define AC3_SINK_BUFFER_TARGET_SAMPLES     384
+#define COMPRESSED_SINK_BUFFER_TARGET_SAMPLES   384
 
 /* See PCM comments above. */
-#define AC3_SINK_SAMPLE_BUFFER_SIZE        32768u
-#define AC3_SINK_SAMPLE_BUFFER_SIZE_MASK   (AC3_SINK_SAMPLE_BUFFER_SIZE - 1u)
+#define COMPRESSED_SINK_SAMPLE_BUFFER_SIZE      32768u
+
+/* Rate control loop gear shifting.
+ * The loop gains above are kept tiny so that pitch changes are
+ * inaudible, which makes the initial lock (and recovery after a
+ * disturbance) very slow. To speed this up, the loop starts out in a
+ * "fast" gear with the gain multiplied by RATE_LOOP_FAST_GAIN_MULT
+ * and the averaging window divided by RATE_LOOP_FAST_HIST_DIV.
+ * Once at least RATE_LOOP_STARTUP_MS have passed since the sink was
+ * opened and the short term average offset has stayed within
+ * RATE_LOOP_LOCK_PERCENT of the target for RATE_LOOP_LOCK_HOLD_MS,
+ * the loop is considered locked and steps down to the normal gain
+ * and window. If the short term average offset ever exceeds
+ * RATE_LOOP_UNLOCK_PERCENT of the target, the loop drops back into
+ * the fast gear until it locks again.
+ */
+#define RATE_LOOP_FAST_GAIN_MULT       16.0
+#define RATE_LOOP_FAST_HIST_DIV        16u
+#define RATE_LOOP_STARTUP_MS           2000u
+#define RATE_LOOP_LOCK_PERCENT         25
+#define RATE_LOOP_LOCK_HOLD_MS         500u
+#define RATE_LOOP_UNLOCK_PERCENT       75
+
+/* While locked, the drift correction carried across gear shifts is
+ * also slowly integrated so that the buffer level settles on the
+ * target instead of some offset from it. The integration time
+ * constant is RATE_LOOP_INTEGRAL_MULT times the averaging window,
+ * which keeps it well below the bandwidth of the proportional part.
+ */
+#define RATE_LOOP_INTEGRAL_MULT        16u
+
+/* Bandwidth (in Hz) of the delay locked loops used to measure the
+ * actual input and output rates in DRIFT_COMP_SRC_PULL mode. Lower
+ * values reject more scheduling jitter but take longer to settle.
+ * The estimate is never allowed to deviate from the nominal rate by
+ * more than RATE_LOOP_DLL_MAX_DEVIATION, and if an event arrives more
+ * than RATE_LOOP_DLL_RESYNC_SEC away from where it was expected, the
+ * loop's time base is just reset.
+ */
+#define RATE_LOOP_DLL_BANDWIDTH        0.02
+#define RATE_LOOP_DLL_MAX_DEVIATION    0.005
+#define RATE_LOOP_DLL_RESYNC_SEC       0.1
+
+/* Size of the history array in the rate control loop. Must be
+ * a power of 2 and at least as large as the largest sink
+ * history size above.
+ */
+#define RATE_LOOP_MAX_HIST_SIZE        512u
+
+/* Adaptive buffer target. When defined, each sink keeps a running
+ * estimate of how far the buffer level dips below its average
+ * (producer jitter) and how late the output thread wakes up
+ * (consumer jitter). Every RATE_LOOP_TARGET_UPDATE_MS, the target
+ * is moved to the smallest value that keeps the probability of
+ * a single update dipping below zero under RATE_LOOP_UNDERRUN_BUDGET.
+ * The estimates are decayed by half every RATE_LOOP_JITTER_DECAY_MS
+ * so that the target can come back down if the system gets quieter.
+ * Each step is limited to RATE_LOOP_TARGET_STEP_PERCENT of the
+ * current target so that the loop never loses lock because of it.
+ */
+#define RATE_LOOP_ADAPTIVE_TARGET      1
+#define RATE_LOOP_UNDERRUN_BUDGET      0.0001
+#define RATE_LOOP_TARGET_UPDATE_MS     1000u
+#define RATE_LOOP_JITTER_DECAY_MS      60000u
+#define RATE_LOOP_TARGET_STEP_PERCENT  25
+/* Minimum number of observations before the target is adjusted. */
+#define RATE_LOOP_JITTER_MIN_SAMPLES   256u
+/* Number of histogram buckets used for the jitter estimates. */
+#define RATE_LOOP_JITTER_BUCKETS       128u
+/* Width of each histogram bucket, in samples. Together with the
+ * number of buckets, this sets the largest jitter that can be told
+ * apart: 1024 samples for PCM (a few input chunks) and 8192 for the
+ * compressed sink (a few decoded frames at 5.1).
+ */
+#define PCM_SINK_JITTER_BUCKET_WIDTH   8u
+#define COMPRESSED_SINK_JITTER_BUCKET_WIDTH 64u
+
+/* Resampler passthrough (DRIFT_COMP_SRC mode only).
+ * If the input and output happen to be driven by the same clock, the
+ * ratio ends up sitting at 1.0 and resampling just burns CPU and
+ * colors the audio. When defined, once the ratio has stayed within
+ * RESAMPLER_PASSTHROUGH_PPM of 1.0 for RESAMPLER_PASSTHROUGH_HOLD_MS,
+ * the converter is bypassed and the samples are copied straight
+ * through (bit-exact). If the ratio ever moves more than
+ * RESAMPLER_PASSTHROUGH_EXIT_PPM away from 1.0, the converter is
+ * brought back in. Both transitions are crossfaded over
+ * RESAMPLER_XFADE_FRAMES frames.
+ * The resampler keeps the last RESAMPLER_HISTORY_FRAMES input frames
+ * (must be a power of 2 and larger than the biggest chunk plus
+ * RESAMPLER_PRIME_FRAMES), and replays the last
+ * RESAMPLER_PRIME_FRAMES of them through the converter when leaving
+ * passthrough so that it picks up exactly where the direct path was.
+ */
+#define RESAMPLER_PASSTHROUGH          1
+#define RESAMPLER_PASSTHROUGH_PPM      5.0
+#define RESAMPLER_PASSTHROUGH_EXIT_PPM 20.0
+#define RESAMPLER_PASSTHROUGH_HOLD_MS  10000u
+#define RESAMPLER_XFADE_FRAMES         128u
+#define RESAMPLER_HISTORY_FRAMES       4096u
+#define RESAMPLER_PRIME_FRAMES         1024u
+#define RESAMPLER_MAX_CHANNELS         8u
+
+/* Time stretching for fast recovery after a stall.
+ * When defined, each sink tracks a smoothed version of its buffer level
+ * (TIME_STRETCH_SMOOTHING is the averaging depth, in chunks). If it rises
+ * above TIME_STRETCH_HIGH_PERCENT of the target, or drops below
+ * TIME_STRETCH_LOW_PERCENT of it, the output is sped up or slowed down
+ * by TIME_STRETCH_SPEED_PERCENT without changing the pitch (WSOLA) until
+ * the level is back within TIME_STRETCH_RELEASE_PERCENT of the target.
+ * The splice period is searched for between TIME_STRETCH_MIN_PERIOD and
+ * TIME_STRETCH_MAX_PERIOD frames (coarse search decimated by
+ * TIME_STRETCH_DECIMATION). While speeding up, up to twice the max period
+ * is held back for the search, which is let back out a chunk at a time
+ * when idle. While slowing down, the search looks at the last twice the
+ * max period of output instead, and at most one period is held back.
+ * TIME_STRETCH_BUF_FRAMES must hold that plus the largest chunk.
+ */
+#define TIME_STRETCH                   1
+#define TIME_STRETCH_SPEED_PERCENT     5
+#define TIME_STRETCH_HIGH_PERCENT      300
+#define TIME_STRETCH_LOW_PERCENT       25
+#define TIME_STRETCH_RELEASE_PERCENT   50
+#define TIME_STRETCH_SMOOTHING         4
+#define TIME_STRETCH_MIN_PERIOD        96u  /* 2 ms */
+#define TIME_STRETCH_MAX_PERIOD        384u /* 8 ms */
+#define TIME_STRETCH_DECIMATION        4u
+#define TIME_STRETCH_BUF_FRAMES        4096u
+#define TIME_STRETCH_MAX_CHANNELS      8u
+
+/* Define this to periodically print sink statistics (buffer level,
+ * rate ratio, loop lock state and gear, etc.).
+ * The interval is in input chunks.
+ */
+//#define PRINT_STATS                    1
+#define STATS_INTERVAL_CHUNKS          375u /* ~1 second */
 
 
 #endif /* _CONFIG_H_ */
@@ -0,0 +1,214 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Raw DTS detector. DTS CDs and LDs carry DTS frames directly in the
+ * PCM samples, without any IEC 61937 wrapper, so the IEC 61937 state
+ * machine never sees them. The frames are back to back, and usually
+ * use 14 bits of each 16 bit word so that they just sound like quiet
+ * noise when played on something that doesn't know about DTS.
+ * This looks for the 14 bit (0x1FFF E800) and 16 bit (0x7FFE 8001)
+ * sync words, repacks 14 bit frames into regular 16 bit ones, and
+ * passes each frame to the callback.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dts_pcm.h"
+
+/* 16 bit sync word, followed by FTYPE = 1 (normal frame) and
+ * SHORT = 31 in the top six bits of the next word.
+ */
+#define DTS_PCM_SYNC_16_0              0x7FFE
+#define DTS_PCM_SYNC_16_1              0x8001
+#define DTS_PCM_SYNC_16_2_MASK         0xFC00
+
+/* Same thing, but in 14 bit words. */
+#define DTS_PCM_SYNC_14_0              0x1FFF
+#define DTS_PCM_SYNC_14_1              0x2800
+#define DTS_PCM_SYNC_14_2              0x07F0
+#define DTS_PCM_SYNC_14_2_MASK         0x3FF0
+#define DTS_PCM_WORD_14_MASK           0x3FFF
+
+/* Smallest valid core frame, in bytes. */
+#define DTS_PCM_MIN_FRAME_SIZE         96u
+
+/* Bytes needed before the frame size can be read out of the header. */
+#define DTS_PCM_HEADER_SIZE            8u
+
+/* Returns n bits from the frame, starting at the given bit offset. */
+static uint32_t get_bits(const uint8_t *data, uint32_t offset, uint32_t n)
+{
+    uint32_t i;
+    uint32_t val = 0;
+
+    for (i = offset; i < (offset + n); i++) {
+        val <<= 1u;
+        val |= (data[i / 8u] >> (7u - (i % 8u))) & 1u;
+    }
+
+    return val;
+}
+
+/* Returns true if the last three words are a sync word. */
+static bool check_sync(struct dts_pcm_fsm *inst)
+{
+    if ((inst->hist[0] == DTS_PCM_SYNC_16_0) &&
+        (inst->hist[1] == DTS_PCM_SYNC_16_1) &&
+        ((inst->hist[2] & DTS_PCM_SYNC_16_2_MASK) == DTS_PCM_SYNC_16_2_MASK)) {
+        inst->is_14bit = false;
+        return true;
+    }
+
+    if (((inst->hist[0] & DTS_PCM_WORD_14_MASK) == DTS_PCM_SYNC_14_0) &&
+        ((inst->hist[1] & DTS_PCM_WORD_14_MASK) == DTS_PCM_SYNC_14_1) &&
+        ((inst->hist[2] & DTS_PCM_SYNC_14_2_MASK) == DTS_PCM_SYNC_14_2)) {
+        inst->is_14bit = true;
+        return true;
+    }
+
+    return false;
+}
+
+/* Add a word to the frame. Returns false if the frame header turned
+ * out to be bogus.
+ */
+static bool put_word(struct dts_pcm_fsm *inst, uint16_t word)
+{
+    uint32_t fsize;
+
+    if (inst->is_14bit) {
+        inst->bits = (inst->bits << 14u) | (word & DTS_PCM_WORD_14_MASK);
+        inst->nr_bits += 14u;
+    } else {
+        inst->bits = (inst->bits << 16u) | word;
+        inst->nr_bits += 16u;
+    }
+
+    while ((inst->nr_bits >= 8u) &&
+           (!inst->frame_size || (inst->frame_len < inst->frame_size))) {
+        inst->frame[inst->frame_len] = inst->bits >> (inst->nr_bits - 8u);
+        inst->frame_len++;
+        inst->nr_bits -= 8u;
+    }
+
+    if (!inst->frame_size && (inst->frame_len >= DTS_PCM_HEADER_SIZE)) {
+        /* Sync (32), FTYPE (1), SHORT (5), CPF (1), NBLKS (7), FSIZE (14). */
+        fsize = get_bits(inst->frame, 46, 14) + 1u;
+        if ((fsize < DTS_PCM_MIN_FRAME_SIZE) || (fsize > DTS_PCM_MAX_FRAME_SIZE)) {
+            return false;
+        }
+
+        inst->frame_size = fsize;
+        inst->frame_samples = (get_bits(inst->frame, 39, 7) + 1u) * 32u;
+    }
+
+    return true;
+}
+
+/* Returns the IEC 61937 data type to pass the frame along as. */
+static uint16_t frame_data_type(struct dts_pcm_fsm *inst)
+{
+    switch (inst->frame_samples) {
+    case 1024:
+        return IEC_61937_DATA_TYPE_DTS2;
+    case 2048:
+        return IEC_61937_DATA_TYPE_DTS3;
+    default:
+        /* Usually 512. */
+        return IEC_61937_DATA_TYPE_DTS1;
+    }
+}
+
+/* Initialize the state machine. */
+void dts_pcm_fsm_init(struct dts_pcm_fsm *inst,
+                      iec_61937_packet_cb frame_cb,
+                      void *cb_data)
+{
+    memset(inst, 0, sizeof(struct dts_pcm_fsm));
+
+    inst->state = DTS_PCM_STATE_SYNC;
+    inst->frame_cb = frame_cb;
+    inst->cb_data = cb_data;
+}
+
+/* Process a single sample. */
+bool dts_pcm_fsm_run(struct dts_pcm_fsm *inst, uint32_t sample32)
+{
+    uint32_t i;
+    /* DTS CDs and LDs are always 16 bit. */
+    const uint16_t sample = sample32 >> 16u;
+
+    switch (inst->state) {
+    case DTS_PCM_STATE_SYNC:
+    case DTS_PCM_STATE_NEXT:
+        inst->hist[0] = inst->hist[1];
+        inst->hist[1] = inst->hist[2];
+        inst->hist[2] = sample;
+        if (inst->hist_count < 3u) {
+            inst->hist_count++;
+        }
+
+        if (inst->hist_count < 3u) {
+            break;
+        }
+
+        if (check_sync(inst)) {
+            /* Only trust it if it follows right after the last frame. */
+            inst->deliver = (inst->state == DTS_PCM_STATE_NEXT);
+            inst->locked = inst->deliver;
+
+            inst->frame_len = 0;
+            inst->frame_size = 0;
+            inst->bits = 0;
+            inst->nr_bits = 0;
+            for (i = 0; i < 3u; i++) {
+                put_word(inst, inst->hist[i]);
+            }
+
+            inst->state = DTS_PCM_STATE_FRAME;
+        } else if (inst->state == DTS_PCM_STATE_NEXT) {
+            /* The next frame should have started by now. */
+            inst->locked = false;
+            inst->state = DTS_PCM_STATE_SYNC;
+        }
+        break;
+    case DTS_PCM_STATE_FRAME:
+        if (!put_word(inst, sample)) {
+            /* False sync. */
+            inst->locked = false;
+            inst->hist_count = 0;
+            inst->state = DTS_PCM_STATE_SYNC;
+            break;
+        }
+
+        if (inst->frame_size && (inst->frame_len == inst->frame_size)) {
+            /* Any bits left in the last word are just padding. */
+            inst->frames++;
+            if (inst->deliver) {
+                inst->frame_cb(frame_data_type(inst), inst->frame_size, inst->frame, inst->cb_data);
+            }
+
+            inst->hist_count = 0;
+            inst->state = DTS_PCM_STATE_NEXT;
+        }
+        break;
+    }
+
+    return inst->locked;
+}
@@ -0,0 +1,82 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DTS_PCM_H_
+#define _DTS_PCM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "iec_61937.h"
+
+/* Max size of a (16 bit packed) DTS core frame. */
+#define DTS_PCM_MAX_FRAME_SIZE         16384u
+
+enum dts_pcm_state {
+    /* Looking for a sync word anywhere. */
+    DTS_PCM_STATE_SYNC,
+    /* Receiving a frame. */
+    DTS_PCM_STATE_FRAME,
+    /* A frame just ended, so the next one has to start right here. */
+    DTS_PCM_STATE_NEXT,
+};
+
+struct dts_pcm_fsm {
+    enum dts_pcm_state state;
+    /* Frames are passed to the same kind of callback as IEC 61937
+     * bursts, with the IEC 61937 DTS data type that matches the
+     * number of samples in the frame.
+     */
+    iec_61937_packet_cb frame_cb;
+    void *cb_data;
+
+    /* Last few words, for spotting the sync word. */
+    uint16_t hist[3];
+    uint32_t hist_count;
+
+    /* Words are 14 bits wide (DTS-CD/LD), or the full 16. */
+    bool is_14bit;
+    bool locked;
+    /* Only frames that start right where the last one ended are sent
+     * on, since IEC 61937 DTS bursts have sync words in them too.
+     */
+    bool deliver;
+
+    /* The frame being received, repacked into 16 bit words. */
+    uint8_t frame[DTS_PCM_MAX_FRAME_SIZE];
+    size_t frame_len;
+    size_t frame_size;
+    uint32_t frame_samples;
+    uint32_t bits;
+    uint32_t nr_bits;
+
+    uint32_t frames;
+};
+
+void dts_pcm_fsm_init(struct dts_pcm_fsm *inst,
+                      iec_61937_packet_cb frame_cb,
+                      void *cb_data);
+
+/* Process a single sample (left justified in 32 bits, like the IEC 61937
+ * state machine). Returns true if locked on to a stream of back to back
+ * DTS frames.
+ */
+bool dts_pcm_fsm_run(struct dts_pcm_fsm *inst, uint32_t sample);
+
+
+#endif /* _DTS_PCM_H_ */
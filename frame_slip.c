@@ -0,0 +1,156 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drift compensation by frame slipping (DRIFT_COMP_SLIP mode).
+ * Clock drift is typically only tens of PPM, which works out to one
+ * frame every few seconds at 48 kHz. So instead of resampling, the
+ * samples are just copied through untouched, and every once in a
+ * while a single frame is dropped or repeated. To make this as
+ * inaudible as possible, the slip is done at the quietest point in
+ * the chunk, and smoothed over with a short crossfade.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "frame_slip.h"
+#include "config.h"
+
+/* Find the quietest place in the chunk to slip a frame. Returns the
+ * index of the first frame of the crossfade.
+ */
+static size_t find_quiet_point(struct frame_slip *inst, const float *in, size_t in_frames)
+{
+    size_t f;
+    size_t j;
+    size_t best;
+    float energy;
+    float best_energy;
+    const size_t ch = inst->channels;
+
+    /* Energy of the first window. The window starts at frame 1 so
+     * that there's always a previous frame to repeat.
+     */
+    energy = 0;
+    for (j = ch; j < ((FRAME_SLIP_XFADE_FRAMES + 1u) * ch); j++) {
+        energy += in[j] * in[j];
+    }
+
+    best = 1;
+    best_energy = energy;
+
+    /* Slide it across the rest of the chunk, one frame at a time. */
+    for (f = 2; f < (in_frames - FRAME_SLIP_XFADE_FRAMES); f++) {
+        for (j = 0; j < ch; j++) {
+            energy -= in[((f - 1u) * ch) + j] * in[((f - 1u) * ch) + j];
+            energy += in[((f + FRAME_SLIP_XFADE_FRAMES - 1u) * ch) + j] *
+                      in[((f + FRAME_SLIP_XFADE_FRAMES - 1u) * ch) + j];
+        }
+
+        if (energy < best_energy) {
+            best_energy = energy;
+            best = f;
+        }
+    }
+
+    return best;
+}
+
+/* Initialize. */
+void frame_slip_init(struct frame_slip *inst, uint32_t channels)
+{
+    memset(inst, 0, sizeof(struct frame_slip));
+
+    inst->channels = channels;
+}
+
+/* Copy a chunk, slipping a frame if needed. */
+size_t frame_slip_process(struct frame_slip *inst,
+                          const float *in,
+                          size_t in_frames,
+                          float *out,
+                          double ratio)
+{
+    size_t i;
+    size_t p;
+    float w;
+    const size_t ch = inst->channels;
+
+    /* The ratio is output/input, so > 1 means that we need to
+     * produce more frames than we're given.
+     */
+    inst->phase += in_frames * (ratio - 1.0);
+
+    /* Don't let this wind up if the loop asks for more than one
+     * frame per chunk.
+     */
+    if (inst->phase > 2.0) {
+        inst->phase = 2.0;
+    } else if (inst->phase < -2.0) {
+        inst->phase = -2.0;
+    }
+
+    if (((inst->phase < 1.0) && (inst->phase > -1.0)) ||
+        (in_frames < (FRAME_SLIP_XFADE_FRAMES + 3u))) {
+        /* Nothing to do. */
+        memcpy(out, in, in_frames * ch * sizeof(float));
+        return in_frames;
+    }
+
+    p = find_quiet_point(inst, in, in_frames);
+
+    /* Everything before the slip is untouched. */
+    memcpy(out, in, p * ch * sizeof(float));
+
+    if (inst->phase >= 1.0) {
+        /* Insert: fade into the same signal delayed by one frame,
+         * then continue from there.
+         */
+        for (i = 0; i < (FRAME_SLIP_XFADE_FRAMES * ch); i++) {
+            w = (float)((i / ch) + 1u) / (FRAME_SLIP_XFADE_FRAMES + 1u);
+            out[(p * ch) + i] = (in[(p * ch) + i] * (1.0f - w)) + (in[((p - 1u) * ch) + i] * w);
+        }
+
+        memcpy(&out[(p + FRAME_SLIP_XFADE_FRAMES) * ch],
+               &in[(p + FRAME_SLIP_XFADE_FRAMES - 1u) * ch],
+               (in_frames - (p + FRAME_SLIP_XFADE_FRAMES - 1u)) * ch * sizeof(float));
+
+        inst->phase -= 1.0;
+        inst->inserted++;
+
+        return in_frames + 1u;
+    }
+
+    /* Drop: fade into the same signal advanced by one frame,
+     * then continue from there.
+     */
+    for (i = 0; i < (FRAME_SLIP_XFADE_FRAMES * ch); i++) {
+        w = (float)((i / ch) + 1u) / (FRAME_SLIP_XFADE_FRAMES + 1u);
+        out[(p * ch) + i] = (in[(p * ch) + i] * (1.0f - w)) + (in[((p + 1u) * ch) + i] * w);
+    }
+
+    memcpy(&out[(p + FRAME_SLIP_XFADE_FRAMES) * ch],
+           &in[(p + FRAME_SLIP_XFADE_FRAMES + 1u) * ch],
+           (in_frames - (p + FRAME_SLIP_XFADE_FRAMES + 1u)) * ch * sizeof(float));
+
+    inst->phase += 1.0;
+    inst->dropped++;
+
+    return in_frames - 1u;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FRAME_SLIP_H_
+#define _FRAME_SLIP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+struct frame_slip {
+    uint32_t channels;
+
+    /* Accumulated difference between the number of frames that the
+     * ratio asked for and the number actually produced.
+     */
+    double phase;
+
+    uint32_t inserted;
+    uint32_t dropped;
+};
+
+void frame_slip_init(struct frame_slip *inst, uint32_t channels);
+
+/* Copy in_frames of interleaved input into out, inserting or dropping
+ * a single frame if the accumulated phase error calls for it.
+ * Out must have room for in_frames + 1 frames.
+ * Returns the number of frames written to out.
+ */
+size_t frame_slip_process(struct frame_slip *inst,
+                          const float *in,
+                          size_t in_frames,
+                          float *out,
+                          double ratio);
+
+
+#endif /* _FRAME_SLIP_H_ */
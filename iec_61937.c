@@ -20,19 +20,248 @@
  * extracts the data bursts from an IEC 61937 stream. Once a full
  * burst is acquired, it sends it to the output by calling the
  * callback that was passed during initialization.
- * For now, this only supports AC3 frames because the length field
- * is dependent on the data type. Sometimes it's bits, sometimes it's
- * bytes...
+ * The units of the length field and the burst repetition period
+ * depend on the data type, so only the types that are listed in the
+ * type table below can be parsed. Anything else is skipped.
+ * SMPTE 337M bursts (from AES3 feeds) are close enough to be handled
+ * here too. They use the same preamble, but without the leading zeros,
+ * and may be sent in 20 or 24 bit words, which get repacked into bytes
+ * so that the payload looks the same as a 16 bit one.
  */
 
+#include <stdio.h>
 #include <string.h>
 
 #include "iec_61937.h"
+#include "config.h"
 
 /* Burst header sync words. */
 #define IEC_61937_SYNC_WORD_0          0xF872
 #define IEC_61937_SYNC_WORD_1          0x4E1F
-#define IEC_61937_DATA_TYPE_MASK       0x3F
+
+/* SMPTE 337M sync words for 20 and 24 bit words. */
+#define SMPTE_337M_20_SYNC_WORD_0      0x6F872
+#define SMPTE_337M_20_SYNC_WORD_1      0x54E1F
+#define SMPTE_337M_24_SYNC_WORD_0      0x96F872
+#define SMPTE_337M_24_SYNC_WORD_1      0xA54E1F
+
+/* Pc bits 0-6 are the data type, and bits 7-15 are the error flag,
+ * data type dependent info, and bitstream number.
+ * In 20 and 24 bit words, Pc is in the top 16 bits, and SMPTE 337M
+ * uses bits 5-6 for the data mode, so the data type is only 5 bits.
+ */
+#define IEC_61937_DATA_TYPE_MASK       0x7F
+#define SMPTE_337M_DATA_TYPE_MASK      0x1F
+#define IEC_61937_TYPE_INFO_SHIFT      7u
+
+/* DTS-HD bursts have their repetition period in Pc bits 8-10, as a
+ * power of 2 times 512 frames.
+ */
+#define IEC_61937_DTSHD_PERIOD_SHIFT   1u
+#define IEC_61937_DTSHD_PERIOD_MASK    0x7
+#define IEC_61937_DTSHD_BASE_PERIOD    512u
+
+struct iec_61937_type {
+    uint16_t data_type;
+    /* Otherwise, it's in bits. */
+    bool length_in_bytes;
+    /* Burst repetition period in frames, or 0 if it varies. */
+    uint32_t period;
+};
+
+/* Everything that the state machine knows how to parse. */
+static const struct iec_61937_type iec_61937_types[] = {
+    { IEC_61937_DATA_TYPE_AC3,          false, 1536u },
+    /* The period comes from the gap length in the payload instead. */
+    { IEC_61937_DATA_TYPE_PAUSE,        false, 0     },
+    { IEC_61937_DATA_TYPE_MPEG1_L1,     false, 384u  },
+    { IEC_61937_DATA_TYPE_MPEG1_L23,    false, 1152u },
+    { IEC_61937_DATA_TYPE_MPEG2_EXT,    false, 1152u },
+    { IEC_61937_DATA_TYPE_MPEG2_AAC,    false, 1024u },
+    { IEC_61937_DATA_TYPE_MPEG2_L1_LSF, false, 768u  },
+    { IEC_61937_DATA_TYPE_MPEG2_L2_LSF, false, 2304u },
+    { IEC_61937_DATA_TYPE_MPEG2_L3_LSF, false, 1152u },
+    { IEC_61937_DATA_TYPE_DTS1,         false, 512u  },
+    { IEC_61937_DATA_TYPE_DTS2,         false, 1024u },
+    { IEC_61937_DATA_TYPE_DTS3,         false, 2048u },
+    /* The period is in Pc instead. */
+    { IEC_61937_DATA_TYPE_DTSHD,        true,  0     },
+    /* Four AC3 periods, since it's normally carried at 192 kHz. */
+    { IEC_61937_DATA_TYPE_EAC3,         true,  6144u },
+    /* 20 ms at 768 kHz (HBR). */
+    { IEC_61937_DATA_TYPE_MAT,          true,  15360u },
+    /* Follows the video frame rate. */
+    { IEC_61937_DATA_TYPE_DOLBY_E,      false, 0     },
+};
+
+/* Returns the table entry for the given data type, or NULL if unknown. */
+static const struct iec_61937_type *lookup_type(uint16_t data_type)
+{
+    size_t i;
+
+    for (i = 0; i < (sizeof(iec_61937_types) / sizeof(iec_61937_types[0])); i++) {
+        if (iec_61937_types[i].data_type == data_type) {
+            return &iec_61937_types[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns the current word (right justified) out of a sample. */
+static uint32_t get_word(struct iec_61937_fsm *inst, uint32_t sample)
+{
+    return sample >> (32u - inst->word_bits);
+}
+
+/* Checks for the first sync word. If found, the word size is set to
+ * match and true is returned.
+ */
+static bool check_sync_0(struct iec_61937_fsm *inst, uint32_t sample)
+{
+    if ((sample >> 16u) == IEC_61937_SYNC_WORD_0) {
+        inst->word_bits = 16u;
+#ifdef SMPTE_337M
+    } else if ((sample >> 8u) == SMPTE_337M_24_SYNC_WORD_0) {
+        inst->word_bits = 24u;
+    } else if ((sample >> 12u) == SMPTE_337M_20_SYNC_WORD_0) {
+        inst->word_bits = 20u;
+#endif
+    } else {
+        return false;
+    }
+
+    inst->sync_pos = inst->pos;
+
+    return true;
+}
+
+/* Checks for the second sync word, which has to be the same size as the first. */
+static bool check_sync_1(struct iec_61937_fsm *inst, uint32_t sample)
+{
+    const uint32_t word = get_word(inst, sample);
+
+    switch (inst->word_bits) {
+    case 24:
+        return (word == SMPTE_337M_24_SYNC_WORD_1);
+    case 20:
+        return (word == SMPTE_337M_20_SYNC_WORD_1);
+    default:
+        return (word == IEC_61937_SYNC_WORD_1);
+    }
+}
+
+/* Called when a burst preamble (at inst->sync_pos) has been confirmed
+ * and the data type is known. Checks where it landed relative to
+ * where it was expected, and sets up the expectation for the next one.
+ */
+static void track_burst(struct iec_61937_fsm *inst, const struct iec_61937_type *type)
+{
+    int32_t jitter;
+    uint32_t abs_jitter;
+    /* In samples. */
+    uint32_t period = type ? (type->period * 2u) : 0;
+
+    if (inst->data_type == IEC_61937_DATA_TYPE_DTSHD) {
+        period = (IEC_61937_DTSHD_BASE_PERIOD * 2u) <<
+                 ((inst->type_info >> IEC_61937_DTSHD_PERIOD_SHIFT) & IEC_61937_DTSHD_PERIOD_MASK);
+    }
+
+    inst->stats.bursts++;
+
+    if (inst->tracking) {
+        jitter = (int32_t)(inst->sync_pos - inst->next_pa_pos) / 2;
+        abs_jitter = (jitter < 0) ? -jitter : jitter;
+
+        inst->stats.last_jitter = jitter;
+        if (abs_jitter > inst->stats.max_jitter) {
+            inst->stats.max_jitter = abs_jitter;
+        }
+    }
+
+    if (!period) {
+        /* Don't know when the next one is due. */
+        inst->tracking = false;
+        return;
+    }
+
+    inst->tracking = true;
+    inst->period = period;
+    inst->next_pa_pos = inst->sync_pos + period;
+}
+
+/* Called for every word while tracking to see if the next burst is late. */
+static void check_missing(struct iec_61937_fsm *inst)
+{
+    if ((int32_t)(inst->pos - inst->next_pa_pos) <= (int32_t)(IEC_61937_PERIOD_TOLERANCE * 2u)) {
+        return;
+    }
+
+    if (!inst->missed_periods) {
+        printf("Missing IEC 61937 burst\n");
+    }
+
+    inst->missed_periods++;
+    inst->stats.missed_bursts++;
+
+    if (inst->missed_periods >= IEC_61937_MAX_MISSED_PERIODS) {
+        /* The stream has stopped. Wait for the next burst to start
+         * tracking again.
+         */
+        inst->tracking = false;
+        return;
+    }
+
+    /* Expect it one period later then. */
+    inst->next_pa_pos += inst->period;
+}
+
+/* Called once the data type and length code are known. Works out the
+ * payload length and gets ready to receive it, or goes back to looking
+ * for the next burst if the data type is unknown.
+ */
+static void start_payload(struct iec_61937_fsm *inst)
+{
+    const struct iec_61937_type *type = lookup_type(inst->data_type);
+
+    track_burst(inst, type);
+
+    if (!type) {
+        /* No idea what units the length is in, so just bail. */
+        inst->state = IEC_61937_STATE_FIRST_0;
+        return;
+    }
+
+    inst->bytes_received = 0;
+    if (type->length_in_bytes) {
+        inst->payload_len = inst->length_code;
+    } else {
+        /* NOTE: It's possible for payload len to be odd, but since we
+         *       process 16 bit samples at a time, the pad byte just gets
+         *       thrown away.
+         */
+        inst->payload_len = inst->length_code / 8u;
+    }
+
+    if (inst->payload_len > IEC_61937_MAX_BURST_PAYLOAD) {
+        /* Only possible with the longer SMPTE 337M length words. */
+        printf("Data burst too large (%zu bytes)\n", inst->payload_len);
+        inst->state = IEC_61937_STATE_FIRST_0;
+        return;
+    }
+
+    inst->bits = 0;
+    inst->nr_bits = 0;
+
+    if (!inst->payload_len) {
+        /* Nothing to wait for. */
+        inst->packet_cb(inst->data_type, 0, inst->payload, inst->cb_data);
+        inst->state = IEC_61937_STATE_FIRST_0;
+        return;
+    }
+
+    inst->state = IEC_61937_STATE_PAYLOAD;
+}
 
 /* Initialize the state machine. */
 void iec_61937_fsm_init(struct iec_61937_fsm *inst,
@@ -48,14 +277,48 @@ void iec_61937_fsm_init(struct iec_61937_fsm *inst,
     return;
 }
 
+/* Add a payload word, repacking it into bytes. */
+static void put_payload_word(struct iec_61937_fsm *inst, uint32_t word)
+{
+    inst->bits = (inst->bits << inst->word_bits) | word;
+    inst->nr_bits += inst->word_bits;
+
+    /* NOTE: Any bits left over at the end of the burst are just padding. */
+    while ((inst->nr_bits >= 8u) && (inst->bytes_received < inst->payload_len)) {
+        inst->payload[inst->bytes_received] = inst->bits >> (inst->nr_bits - 8u);
+        inst->bytes_received++;
+        inst->nr_bits -= 8u;
+    }
+}
+
 /* Process a single sample. Returns true if locked on to a valid 61937 stream. */
-bool iec_61937_fsm_run(struct iec_61937_fsm *inst, uint16_t s16le_sample)
+bool iec_61937_fsm_run(struct iec_61937_fsm *inst, uint32_t sample)
 {
     bool ret;
-    uint16_t sample;
+    uint16_t pc;
+    uint32_t gap;
 
     ret = false;
-    sample = __builtin_bswap16(s16le_sample);
+
+    inst->pos++;
+
+    if (inst->tracking) {
+        check_missing(inst);
+    }
+
+    if (inst->skip_words) {
+        /* Stuffing between bursts, no need to look at it. */
+        inst->skip_words--;
+        return false;
+    }
+
+#ifdef SMPTE_337M
+    /* No leading zeros needed. */
+    if ((inst->state < IEC_61937_STATE_SYNC_0) && check_sync_0(inst, sample)) {
+        inst->state = IEC_61937_STATE_SYNC_1;
+        return false;
+    }
+#endif
 
     switch (inst->state) {
     case IEC_61937_STATE_FIRST_0:
@@ -87,61 +350,69 @@ bool iec_61937_fsm_run(struct iec_61937_fsm *inst, uint16_t s16le_sample)
     case IEC_61937_STATE_SYNC_0:
         if (sample == 0x0000) {
             /* Do nothing - might be receiving a stream of 0's. */
-        } else if (sample == IEC_61937_SYNC_WORD_0) {
+        } else if (check_sync_0(inst, sample)) {
             inst->state = IEC_61937_STATE_SYNC_1;
         } else {
             inst->state = IEC_61937_STATE_FIRST_0;
         }
         break;
     case IEC_61937_STATE_SYNC_1:
-        if (sample == IEC_61937_SYNC_WORD_1) {
+        if (check_sync_1(inst, sample)) {
             inst->state = IEC_61937_STATE_DATA_TYPE;
+            /* Whatever it turns out to be, the stream is still alive. */
+            inst->missed_periods = 0;
         } else {
             inst->state = IEC_61937_STATE_FIRST_0;
         }
         break;
     case IEC_61937_STATE_DATA_TYPE:
-        inst->data_type = sample & IEC_61937_DATA_TYPE_MASK;
-        inst->state = IEC_61937_STATE_LENGTH;
-        if (inst->data_type == IEC_61937_DATA_TYPE_EXTENDED) {
-            /* We don't support the extended headers yet. */
-            inst->state = IEC_61937_STATE_FIRST_0;
+        pc = sample >> 16u;
+        if (inst->word_bits == 16u) {
+            inst->data_type = pc & IEC_61937_DATA_TYPE_MASK;
+        } else {
+            inst->data_type = pc & SMPTE_337M_DATA_TYPE_MASK;
         }
+        inst->type_info = pc >> IEC_61937_TYPE_INFO_SHIFT;
+        inst->state = IEC_61937_STATE_LENGTH;
         break;
     case IEC_61937_STATE_LENGTH:
-        if (inst->data_type == IEC_61937_DATA_TYPE_AC3) {
-            inst->bytes_received = 0;
-            inst->payload_len = sample / 8u;
-
-            /* NOTE: It's possible for payload len to be odd, but since we
-             *       process 16 bit samples at a time, the pad byte just gets
-             *       thrown away.
-             */
-            inst->state = IEC_61937_STATE_PAYLOAD;
+        inst->length_code = get_word(inst, sample);
+        if (inst->data_type == IEC_61937_DATA_TYPE_EXTENDED) {
+            /* The actual type follows in the extended subtype word. */
+            inst->state = IEC_61937_STATE_EXTENDED_TYPE;
         } else {
-            /* The length field units depend on the data type. For AC3, it's bits
-             * but there's no default, so bail.
-             */
-            inst->state = IEC_61937_STATE_FIRST_0;
+            start_payload(inst);
         }
         break;
+    case IEC_61937_STATE_EXTENDED_TYPE:
+        inst->data_type = IEC_61937_EXTENDED_TYPE(sample >> 16u);
+        start_payload(inst);
+        break;
     case IEC_61937_STATE_PAYLOAD:
-        if ((inst->payload_len - inst->bytes_received) >= 2u) {
-            /* Copy whole sample. */
-            inst->payload[inst->bytes_received] = (sample >> 8u);
-            inst->bytes_received++;
-            inst->payload[inst->bytes_received] = sample;
-            inst->bytes_received++;
-        } else {
-            /* Only need one more byte. */
-            inst->payload[inst->bytes_received] = (sample >> 8u);
-            inst->bytes_received++;
-        }
+        put_payload_word(inst, get_word(inst, sample));
 
         if (inst->payload_len == inst->bytes_received) {
             /* Send it. */
             inst->packet_cb(inst->data_type, inst->bytes_received, inst->payload, inst->cb_data);
             inst->state = IEC_61937_STATE_FIRST_0;
+
+            if (inst->data_type == IEC_61937_DATA_TYPE_PAUSE) {
+                /* The next burst (pause or not) shows up once the gap is over. */
+                gap = iec_61937_pause_gap_length(inst->payload, inst->bytes_received);
+                if (gap) {
+                    inst->tracking = true;
+                    inst->period = gap * 2u;
+                    inst->next_pa_pos = inst->sync_pos + inst->period;
+                }
+            }
+
+            /* If we know when the next burst is due, skip straight to
+             * a little before its leading zeros.
+             */
+            if (inst->tracking &&
+                ((int32_t)(inst->next_pa_pos - inst->pos) > (int32_t)((IEC_61937_PERIOD_TOLERANCE * 2u) + 5u))) {
+                inst->skip_words = inst->next_pa_pos - inst->pos - ((IEC_61937_PERIOD_TOLERANCE * 2u) + 5u);
+            }
         }
         break;
     }
@@ -152,4 +423,35 @@ bool iec_61937_fsm_run(struct iec_61937_fsm *inst, uint16_t s16le_sample)
     }
 
     return ret;
-}
\ No newline at end of file
+}
+
+/* Get the number of missed periods in a row. */
+uint32_t iec_61937_fsm_missed_periods(struct iec_61937_fsm *inst)
+{
+    return inst->missed_periods;
+}
+
+/* Get a snapshot of the burst statistics. */
+void iec_61937_fsm_get_stats(struct iec_61937_fsm *inst, struct iec_61937_stats *stats)
+{
+    *stats = inst->stats;
+}
+
+/* Look up the repetition period of a data type. */
+uint32_t iec_61937_period(uint16_t data_type)
+{
+    const struct iec_61937_type *type = lookup_type(data_type);
+
+    return type ? type->period : 0;
+}
+
+/* Get the gap length out of a pause burst. */
+uint32_t iec_61937_pause_gap_length(const uint8_t *payload, size_t len)
+{
+    if (len < 2u) {
+        return 0;
+    }
+
+    /* First word of the payload, in frames. */
+    return ((uint32_t)payload[0] << 8u) | payload[1];
+}
@@ -25,16 +25,43 @@
 /* Max burst payload length (assuming the length is in bytes). */
 #define IEC_61937_MAX_BURST_PAYLOAD    0x10000
 
+/* Extended data types (signalled by IEC_61937_DATA_TYPE_EXTENDED in
+ * Pc) are passed around as the extended subtype word plus this, so
+ * that they don't collide with the regular ones.
+ */
+#define IEC_61937_EXTENDED_TYPE(x)     (0x100u | (x))
+
 enum iec_61937_data_type {
-    IEC_61937_DATA_TYPE_AC3      = 0x01,
-    IEC_61937_DATA_TYPE_EXTENDED = 0x1F,
+    IEC_61937_DATA_TYPE_AC3           = 0x01,
+    IEC_61937_DATA_TYPE_PAUSE         = 0x03,
+    IEC_61937_DATA_TYPE_MPEG1_L1      = 0x04,
+    /* MPEG-1 layer 2 or 3, or MPEG-2 without extension. */
+    IEC_61937_DATA_TYPE_MPEG1_L23     = 0x05,
+    IEC_61937_DATA_TYPE_MPEG2_EXT     = 0x06,
+    IEC_61937_DATA_TYPE_MPEG2_AAC     = 0x07,
+    /* MPEG-2 low sampling frequency. */
+    IEC_61937_DATA_TYPE_MPEG2_L1_LSF  = 0x08,
+    IEC_61937_DATA_TYPE_MPEG2_L2_LSF  = 0x09,
+    IEC_61937_DATA_TYPE_MPEG2_L3_LSF  = 0x0A,
+    IEC_61937_DATA_TYPE_DTS1          = 0x0B,
+    IEC_61937_DATA_TYPE_DTS2          = 0x0C,
+    IEC_61937_DATA_TYPE_DTS3          = 0x0D,
+    /* DTS type IV (DTS-HD). */
+    IEC_61937_DATA_TYPE_DTSHD         = 0x11,
+    IEC_61937_DATA_TYPE_EAC3          = 0x15,
+    /* MAT (TrueHD). */
+    IEC_61937_DATA_TYPE_MAT           = 0x16,
+    /* SMPTE 337M only. */
+    IEC_61937_DATA_TYPE_DOLBY_E       = 0x1C,
+    IEC_61937_DATA_TYPE_EXTENDED      = 0x1F,
 };
 
 enum iec_61937_state {
     /* IEC 61937 states that there should always be four 16 bit samples
      * before every burst header. This is supposed to make it easier to
      * identify IEC 61937 streams by effectively increasing the sync word
-     * to 96 bits.
+     * to 96 bits. SMPTE 337M doesn't have them, so with SMPTE_337M
+     * defined, the first sync word is also looked for in these states.
      */
     IEC_61937_STATE_FIRST_0,
     IEC_61937_STATE_SECOND_0,
@@ -44,10 +71,19 @@ enum iec_61937_state {
     IEC_61937_STATE_SYNC_1,
     IEC_61937_STATE_DATA_TYPE,
     IEC_61937_STATE_LENGTH,
+    IEC_61937_STATE_EXTENDED_TYPE,
     IEC_61937_STATE_PAYLOAD,
 };
 
-typedef void (*iec_61937_packet_cb)(uint8_t data_type,
+struct iec_61937_stats {
+    uint32_t bursts;
+    uint32_t missed_bursts;
+    /* Offset of the last burst from where it was expected, in frames. */
+    int32_t last_jitter;
+    uint32_t max_jitter;
+};
+
+typedef void (*iec_61937_packet_cb)(uint16_t data_type,
                                     size_t len,
                                     uint8_t *payload,
                                     void *handle);
@@ -56,17 +92,60 @@ struct iec_61937_fsm {
     enum iec_61937_state state;
     iec_61937_packet_cb packet_cb;
     void *cb_data;
-    uint8_t data_type;
+    uint16_t data_type;
+    /* Pc bits 7-15 of the current burst. */
+    uint16_t type_info;
+    uint32_t length_code;
+    /* Word size of the current burst. Always 16 for IEC 61937, but
+     * SMPTE 337M can also use 20 or 24 bit words.
+     */
+    uint32_t word_bits;
     size_t payload_len;
     size_t bytes_received;
     uint8_t payload[IEC_61937_MAX_BURST_PAYLOAD];
+    /* Payload bits that don't make up a whole byte yet. */
+    uint32_t bits;
+    uint32_t nr_bits;
+
+    /* Burst repetition period tracking. All positions are in samples
+     * (so two per frame) and wrap.
+     */
+    uint32_t pos;
+    uint32_t sync_pos;
+    uint32_t next_pa_pos;
+    uint32_t period;
+    bool tracking;
+    uint32_t missed_periods;
+    uint32_t skip_words;
+    struct iec_61937_stats stats;
 };
 
 void iec_61937_fsm_init(struct iec_61937_fsm *inst,
                         iec_61937_packet_cb packet_cb,
                         void *cb_data);
 
-bool iec_61937_fsm_run(struct iec_61937_fsm *inst, uint16_t s16le_sample);
+/* Process a single sample. The sample is left justified in 32 bits, so
+ * a 16 bit sample is in the top half. Returns true if locked on to a
+ * valid 61937 stream.
+ */
+bool iec_61937_fsm_run(struct iec_61937_fsm *inst, uint32_t sample);
+
+/* Returns the burst repetition period (in frames) of the given data
+ * type, or 0 if it's unknown or varies.
+ */
+uint32_t iec_61937_period(uint16_t data_type);
+
+/* Returns the gap length (in frames) from a pause burst payload,
+ * or 0 if it doesn't have one.
+ */
+uint32_t iec_61937_pause_gap_length(const uint8_t *payload, size_t len);
+
+/* Returns the number of burst repetition periods in a row that have
+ * passed without the expected burst showing up.
+ */
+uint32_t iec_61937_fsm_missed_periods(struct iec_61937_fsm *inst);
+
+void iec_61937_fsm_get_stats(struct iec_61937_fsm *inst, struct iec_61937_stats *stats);
 
 
 #endif /* _IEC_61937_H_ */
@@ -19,8 +19,9 @@
  * audio_async_loopback main. Reads from the input and automatically
  * determines whether the incoming audio is PCM or an IEC 61937 bitstream
  * and sends the data to the appropriate sink for decoding and playback.
- * As of now, the only IEC 61937 format supported is 5.1 Channel AC3.
- * Other format support could easily be added later if necessary.
+ * All of the supported IEC 61937 formats (AC3, E-AC3, DTS, MPEG audio,
+ * and AAC) go to the same compressed audio sink, which picks the
+ * decoder based on the burst data type.
  */
 
 #include <stdlib.h>
@@ -36,95 +37,566 @@
 
 #include "config.h"
 #include "iec_61937.h"
+#include "dts_pcm.h"
+#include "rate_detect.h"
 #include "pcm_sink.h"
-#include "ac3_sink.h"
+#include "compressed_sink.h"
+
+/* Size of an input chunk, in frames. */
+#define INPUT_FRAME_SIZE               (INPUT_CHANNELS * INPUT_SAMPLE_BYTES)
+#define INPUT_CHUNK_FRAMES             (INPUT_CHUNK_SIZE / INPUT_FRAME_SIZE)
+
+/* Number of channels in each frame that the IEC 61937 stream is
+ * carried in. Only HBR streams use more than the first pair.
+ */
+#ifdef INPUT_HBR
+#define INPUT_BITSTREAM_CHANNELS       INPUT_CHANNELS
+#else
+#define INPUT_BITSTREAM_CHANNELS       2u
+#endif
+
+#if (INPUT_CHUNK_SIZE % INPUT_FRAME_SIZE)
+#error "INPUT_CHUNK_SIZE must be a multiple of the frame size"
+#endif
+
+#if defined(INPUT_HBR) && (INPUT_CHANNELS != 8)
+#error "HBR input needs INPUT_CHANNELS to be 8"
+#endif
 
 enum iec_60958_state {
     IEC_60958_STATE_UNKNOWN,
     IEC_60958_STATE_PCM,
-    /* Only AC3 is supported for now, with non-AC3 packets getting dropped
-     * in the output handler. If more formats are added, the 61937 state
-     * should be split into unique states for each format since they will
-     * each require different sink implementations.
+    /* Every compressed format goes to the same sink, which picks the
+     * decoder per burst. Unsupported ones are dropped in the output
+     * handler.
      */
     IEC_60958_STATE_61937,
 };
 
+/* A data burst that was received before the sink was open. */
+struct iec_60958_pending_burst {
+    uint16_t data_type;
+    size_t len;
+    uint8_t payload[PENDING_BURST_MAX_SIZE];
+};
+
 struct iec_60958 {
     enum iec_60958_state state;
     struct iec_61937_fsm iec_61937_fsm_inst;
+#ifdef DTS_PCM_DETECTION
+    struct dts_pcm_fsm dts_pcm_fsm_inst;
+#endif
     size_t non_61937_chunks;
     struct pcm_sink pcm_sink;
-    struct ac3_sink ac3_sink;
+    struct compressed_sink compressed_sink;
     uint32_t sink_latency_us;
+    size_t stats_chunks;
+
+    /* Rate that the input is actually running at. */
+    uint32_t input_rate;
+#ifdef RATE_DETECT
+    struct rate_detect rate_detect;
+#endif
+
+    /* Capture backlog handling. */
+    size_t backlog_chunks;
+    uint32_t capture_latency_us;
+    uint32_t skip_chunks;
+    uint32_t skip_burst_us;
+    uint32_t catchups;
+
+#if PCM_LOOKAHEAD_CHUNKS
+    /* PCM lookahead delay line. */
+    uint8_t lookahead[PCM_LOOKAHEAD_CHUNKS][INPUT_CHUNK_SIZE];
+    uint32_t lookahead_idx;
+    uint32_t lookahead_count;
+#endif
+    uint32_t suppressed_chunks;
+
+    /* Bursts received while the stream was being detected. */
+    struct iec_60958_pending_burst pending[PENDING_BURSTS];
+    uint32_t nr_pending;
+
+    /* Bursts that the compressed sink can't play (like Dolby E from a
+     * SMPTE 337M feed) are handed to this instead.
+     */
+    iec_61937_packet_cb aux_burst_cb;
+    void *aux_burst_data;
+    uint32_t aux_bursts;
+    uint16_t aux_data_type;
 };
 
+/* Returns the duration of an input chunk. */
+static uint32_t iec_60958_chunk_us(struct iec_60958 *inst)
+{
+    return ((uint64_t)INPUT_CHUNK_FRAMES * 1000000u) / inst->input_rate;
+}
+
+/* Returns the rate of the IEC 60958 frames that carry the bitstream
+ * (HBR streams pack four of them into each 8 channel frame).
+ */
+static uint32_t iec_60958_transport_rate(struct iec_60958 *inst)
+{
+    return inst->input_rate * (INPUT_BITSTREAM_CHANNELS / 2u);
+}
+
+/* Sends a data burst to the sink. */
+static void iec_60958_play_burst(struct iec_60958 *inst,
+                                 uint16_t data_type,
+                                 uint8_t *payload,
+                                 size_t len)
+{
+    uint32_t gap;
+
+    if (data_type == IEC_61937_DATA_TYPE_PAUSE) {
+        /* Fill the gap with silence so that the output keeps running. */
+        gap = iec_61937_pause_gap_length(payload, len);
+        if (gap) {
+            compressed_sink_pause(&inst->compressed_sink, gap, iec_60958_transport_rate(inst));
+        }
+        return;
+    }
+
+    compressed_sink_process(&inst->compressed_sink, data_type, payload, len);
+}
+
+/* Default handler for bursts that can't be played. These are just
+ * counted, and logged whenever the type changes.
+ */
+static void iec_60958_aux_burst_log(uint16_t data_type,
+                                    size_t len,
+                                    uint8_t *payload,
+                                    void *handle)
+{
+    struct iec_60958 *inst = (struct iec_60958 *)handle;
+
+    if (!inst->aux_bursts || (data_type != inst->aux_data_type)) {
+        printf("Ignoring data bursts of type 0x%x (%zu bytes)\n", data_type, len);
+    }
+
+    inst->aux_bursts++;
+    inst->aux_data_type = data_type;
+}
+
 /* Callback that is called from the IEC 61937 state machine
  * for every data burst received.
  */
-static void iec_61937_packet_handler(uint8_t data_type,
+static void iec_61937_packet_handler(uint16_t data_type,
                                      size_t len,
                                      uint8_t *payload,
                                      void *handle)
 {
+    uint32_t burst_us;
     struct iec_60958 *inst = (struct iec_60958 *)handle;
 
-    if (inst->state != IEC_60958_STATE_61937) {
-        /* We may still be in the "UNKNOWN" state... */
+    if ((data_type != IEC_61937_DATA_TYPE_PAUSE) &&
+        !compressed_sink_supports(data_type)) {
+        /* Can't be decoded here, so let someone else have a look. */
+        if (inst->aux_burst_cb) {
+            inst->aux_burst_cb(data_type, len, payload, inst->aux_burst_data);
+        }
         return;
     }
 
-    if (data_type != IEC_61937_DATA_TYPE_AC3) {
-        /* Discard non-AC3 data. This also discards pause data bursts
-         * (if they're actually present in the stream).
+    if (inst->state != IEC_60958_STATE_61937) {
+        /* We may still be in the "UNKNOWN" or PCM state, in which case
+         * the sink isn't open yet. Hold on to the burst so that it can
+         * be played once it is.
          */
+        if (len > PENDING_BURST_MAX_SIZE) {
+            printf("Burst too large to queue (%zu bytes)\n", len);
+            return;
+        }
+
+        if (inst->nr_pending == PENDING_BURSTS) {
+            /* Drop the oldest one. */
+            memmove(&inst->pending[0], &inst->pending[1], sizeof(inst->pending[0]) * (PENDING_BURSTS - 1u));
+            inst->nr_pending--;
+        }
+
+        inst->pending[inst->nr_pending].data_type = data_type;
+        inst->pending[inst->nr_pending].len = len;
+        memcpy(inst->pending[inst->nr_pending].payload, payload, len);
+        inst->nr_pending++;
         return;
     }
 
-    ac3_sink_process(&inst->ac3_sink, payload, len);
+    if (inst->skip_burst_us) {
+        /* Catching up on a capture backlog. Drop whole bursts for as
+         * long as they fit into what's left to skip.
+         */
+        burst_us = ((uint64_t)iec_61937_period(data_type) * 2u * 1000000u) / (inst->input_rate * INPUT_BITSTREAM_CHANNELS);
+        if (burst_us && (burst_us <= inst->skip_burst_us)) {
+            inst->skip_burst_us -= burst_us;
+            return;
+        }
+        inst->skip_burst_us = 0;
+    }
+
+    iec_60958_play_burst(inst, data_type, payload, len);
 }
 
-/* Passes a chunk to the IEC 61937 state machine and
- * returns true of an IEC 61937 stream was detected
- * within the chunk.
- * NOTE: Chunk size must be a multiple of 2.
+/* Passes a chunk to the IEC 61937 (and raw DTS) state
+ * machines and returns true of an IEC 61937 stream was
+ * detected within the chunk. Only the first
+ * INPUT_BITSTREAM_CHANNELS of each frame are looked at.
+ * NOTE: Chunk size must be a multiple of INPUT_FRAME_SIZE.
  * TODO: Instead of passing around byte arrays, maybe pass around s16 arrays.
  */
-static bool process_chunk_iec_61937(struct iec_61937_fsm *inst,
+static bool process_chunk_iec_61937(struct iec_60958 *inst,
                                     uint8_t *chunk,
                                     size_t chunk_size)
 {
     bool ret;
     size_t i;
-    uint16_t sample;
+    uint32_t j;
+    uint32_t sample;
+    uint8_t *ptr;
 
     ret = false;
 
-    for (i = 0; i < chunk_size; i += 2) {
-        sample = chunk[i];
-        sample <<= 8u;
-        sample |= chunk[i + 1];
+    for (i = 0; i < (chunk_size / INPUT_SAMPLE_BYTES); i++) {
+        if ((i % INPUT_CHANNELS) >= INPUT_BITSTREAM_CHANNELS) {
+            /* Not part of the bitstream. */
+            continue;
+        }
+
+        /* Left justify the little endian sample. */
+        ptr = &chunk[i * INPUT_SAMPLE_BYTES];
+        sample = 0;
+        for (j = 0; j < INPUT_SAMPLE_BYTES; j++) {
+            sample |= (uint32_t)ptr[j] << (8u * (4u - INPUT_SAMPLE_BYTES + j));
+        }
 
-        if (iec_61937_fsm_run(inst, sample)) {
+        if (iec_61937_fsm_run(&inst->iec_61937_fsm_inst, sample)) {
             ret = true;
         }
+
+#ifdef DTS_PCM_DETECTION
+        if (dts_pcm_fsm_run(&inst->dts_pcm_fsm_inst, sample)) {
+            ret = true;
+        }
+#endif
     }
 
     return ret;
 }
 
-/* Initializes an IEC 60958 context. */
-static void iec_60958_init(struct iec_60958 *inst)
+/* Initializes an IEC 60958 context. Returns 0 on success. */
+static int iec_60958_init(struct iec_60958 *inst, const pa_channel_map *pcm_map)
 {
     memset(inst, 0, sizeof(struct iec_60958));
 
     inst->state = IEC_60958_STATE_UNKNOWN;
+    inst->input_rate = INPUT_SAMPLE_RATE;
+#ifdef RATE_DETECT
+    rate_detect_init(&inst->rate_detect, INPUT_SAMPLE_RATE);
+#endif
     iec_61937_fsm_init(&inst->iec_61937_fsm_inst, iec_61937_packet_handler, inst);
+#ifdef DTS_PCM_DETECTION
+    dts_pcm_fsm_init(&inst->dts_pcm_fsm_inst, iec_61937_packet_handler, inst);
+#endif
+    inst->aux_burst_cb = iec_60958_aux_burst_log;
+    inst->aux_burst_data = inst;
+
+    /* Get the decoder ready now so that there's as little delay as
+     * possible when the first IEC 61937 stream shows up.
+     */
+    compressed_sink_init(&inst->compressed_sink);
+
+    return pcm_sink_init(&inst->pcm_sink, pcm_map);
+}
+
+/* Switches to the IEC 61937 state, opens the sink, and plays any
+ * bursts that were received while the stream was being detected.
+ */
+static void iec_60958_start_61937(struct iec_60958 *inst)
+{
+    uint32_t i;
+
+    inst->non_61937_chunks = 0;
+    inst->state = IEC_60958_STATE_61937;
+
+    /* A backlog skip is counted in the units of the old state, so it
+     * doesn't carry over.
+     */
+    inst->skip_chunks = 0;
+    inst->skip_burst_us = 0;
+
+    compressed_sink_open(&inst->compressed_sink, inst->sink_latency_us);
+
+    for (i = 0; i < inst->nr_pending; i++) {
+        iec_60958_play_burst(inst,
+                             inst->pending[i].data_type,
+                             inst->pending[i].payload,
+                             inst->pending[i].len);
+    }
+
+    if (inst->nr_pending) {
+        printf("Replayed %u burst(s) received during detection\n", inst->nr_pending);
+    }
+
+    inst->nr_pending = 0;
+}
+
+#ifdef PRINT_STATS
+/* Print the statistics of a sink core. */
+static void iec_60958_print_sink_stats(const char *name, const struct sink_core_stats *stats)
+{
+    printf("%s: Buffer: %04u    Ratio: %f    Avg: %d    Lock: %d    Gear: %s    Shifts: %u\n",
+           name,
+           stats->buffer_used,
+           stats->loop.ratio,
+           stats->loop.average,
+           stats->loop.locked,
+           rate_loop_gear_str(stats->loop.gear),
+           stats->loop.gear_shifts);
+    printf("%s: Target: %d    Level dips: %d    Wakeup jitter: %d    CPU: %.2f%%    Rate updates: %u\n",
+           name,
+           stats->loop.target,
+           stats->loop.excursion,
+           stats->loop.wakeup_jitter,
+           stats->cpu_percent,
+           stats->rate_updates);
+#ifdef TIME_STRETCH
+    printf("%s: Stretch speed: %f    Stretch engagements: %u    Splices: %u\n",
+           name,
+           stats->stretch_speed,
+           stats->stretch_engagements,
+           stats->stretch_splices);
+#endif
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+    printf("%s: Measured ratio: %f\n", name, stats->measured_ratio);
+#elif DRIFT_COMP_MODE == DRIFT_COMP_SRC
+    printf("%s: Passthrough: %d    Passthrough entries: %u\n",
+           name,
+           stats->passthrough,
+           stats->passthrough_entries);
+#elif DRIFT_COMP_MODE == DRIFT_COMP_SLIP
+    printf("%s: Inserted frames: %u    Dropped frames: %u\n",
+           name,
+           stats->inserted_frames,
+           stats->dropped_frames);
+#endif
+}
+
+/* Periodically print the statistics of whichever sink is open. */
+static void iec_60958_print_stats(struct iec_60958 *inst)
+{
+    struct sink_core_stats pcm_stats;
+    struct compressed_sink_stats compressed_stats;
+    struct iec_61937_stats burst_stats;
+
+    inst->stats_chunks++;
+    if (inst->stats_chunks < STATS_INTERVAL_CHUNKS) {
+        return;
+    }
+    inst->stats_chunks = 0;
+
+    printf("Capture latency: %u us    Catch-ups: %u\n", inst->capture_latency_us, inst->catchups);
+#ifdef RATE_DETECT
+    printf("Input rate: %u    Measured: %.1f    Rate changes: %u\n",
+           inst->input_rate,
+           inst->rate_detect.measured_rate,
+           inst->rate_detect.changes);
+#endif
+
+    switch (inst->state) {
+    case IEC_60958_STATE_PCM:
+        pcm_sink_get_stats(&inst->pcm_sink, &pcm_stats);
+        printf("PCM: Lookahead: %u us    Suppressed chunks: %u\n",
+               PCM_LOOKAHEAD_CHUNKS * iec_60958_chunk_us(inst),
+               inst->suppressed_chunks);
+        iec_60958_print_sink_stats("PCM", &pcm_stats);
+        break;
+    case IEC_60958_STATE_61937:
+        compressed_sink_get_stats(&inst->compressed_sink, &compressed_stats);
+        iec_61937_fsm_get_stats(&inst->iec_61937_fsm_inst, &burst_stats);
+        printf("61937: Bursts: %u    Missed: %u    Burst jitter: %d    Max jitter: %u\n",
+               burst_stats.bursts,
+               burst_stats.missed_bursts,
+               burst_stats.last_jitter,
+               burst_stats.max_jitter);
+        printf("61937: Pauses: %u    Pause frames: %u    Other bursts: %u\n",
+               compressed_stats.pauses,
+               compressed_stats.pause_frames,
+               inst->aux_bursts);
+#ifdef DTS_PCM_DETECTION
+        printf("61937: Raw DTS frames: %u    14 bit: %d\n",
+               inst->dts_pcm_fsm_inst.frames,
+               inst->dts_pcm_fsm_inst.is_14bit);
+#endif
+        iec_60958_print_sink_stats("61937", &compressed_stats.core);
+        break;
+    default:
+        break;
+    }
+}
+#endif
+
+/* Checks how much data is queued up on the capture side (i.e., how
+ * far behind we are in reading it, like after being descheduled) and
+ * if it's too much, schedules some of it to be dropped so that the
+ * sinks don't end up playing it late. PCM is dropped in whole chunks,
+ * and IEC 61937 streams in whole bursts so the decoder stays in sync.
+ */
+static void iec_60958_check_backlog(struct iec_60958 *inst, pa_simple *pa_inst)
+{
+    int error;
+    pa_usec_t latency;
+    uint32_t excess_us;
+
+    inst->backlog_chunks++;
+    if (inst->backlog_chunks < CAPTURE_BACKLOG_CHECK_CHUNKS) {
+        return;
+    }
+    inst->backlog_chunks = 0;
+
+    if (inst->skip_chunks || inst->skip_burst_us) {
+        /* Still working on the last one. */
+        return;
+    }
+
+    latency = pa_simple_get_latency(pa_inst, &error);
+    if (latency == (pa_usec_t)-1) {
+        printf("Could not get capture latency (error = %d)\n", error);
+        return;
+    }
+
+    /* The latency is worked out from the nominal capture rate, so
+     * scale it if the frames are really coming in at another one.
+     */
+    latency = (latency * INPUT_SAMPLE_RATE) / inst->input_rate;
+    inst->capture_latency_us = latency;
+
+    if (latency < CAPTURE_BACKLOG_THRESHOLD_US) {
+        return;
+    }
+
+    excess_us = latency - CAPTURE_BACKLOG_TARGET_US;
+
+    switch (inst->state) {
+    case IEC_60958_STATE_PCM:
+        inst->skip_chunks = excess_us / iec_60958_chunk_us(inst);
+        break;
+    case IEC_60958_STATE_61937:
+        inst->skip_burst_us = excess_us;
+        break;
+    default:
+        /* Nothing is being played yet. */
+        return;
+    }
+
+    if (inst->skip_chunks || inst->skip_burst_us) {
+        inst->catchups++;
+        printf("Capture backlog of %u us; skipping %u chunks/%u us of bursts\n",
+               inst->capture_latency_us,
+               inst->skip_chunks,
+               inst->skip_burst_us);
+    }
+}
+
+/* Plays a PCM chunk, unless we're catching up on a capture backlog. */
+static void iec_60958_play_pcm(struct iec_60958 *inst, uint8_t *chunk)
+{
+    if (inst->skip_chunks) {
+        /* Catching up on a capture backlog. */
+        inst->skip_chunks--;
+        return;
+    }
+
+    pcm_sink_process(&inst->pcm_sink, chunk, INPUT_CHUNK_SIZE);
+}
+
+/* Empties the PCM lookahead delay line without playing it. */
+static void iec_60958_reset_lookahead(struct iec_60958 *inst)
+{
+#if PCM_LOOKAHEAD_CHUNKS
+    inst->suppressed_chunks += inst->lookahead_count;
+    inst->lookahead_idx = 0;
+    inst->lookahead_count = 0;
+#endif
+}
+
+/* Go from 61937 back to PCM. */
+static void iec_60958_fallback_pcm(struct iec_60958 *inst)
+{
+    inst->state = IEC_60958_STATE_PCM;
+    inst->non_61937_chunks = 0;
+    inst->skip_chunks = 0;
+    inst->skip_burst_us = 0;
+    iec_60958_reset_lookahead(inst);
+
+    compressed_sink_close(&inst->compressed_sink);
+    pcm_sink_open(&inst->pcm_sink, inst->sink_latency_us, inst->input_rate);
+}
+
+#ifdef RATE_DETECT
+/* Checks whether the input has switched to a different sampling rate,
+ * and if so, drops whatever was captured around the switch and reopens
+ * the PCM sink at the new rate. The compressed sink doesn't need to be
+ * touched, since it already follows the rate of the decoded audio.
+ */
+static void iec_60958_check_rate(struct iec_60958 *inst, pa_simple *pa_inst)
+{
+    int error;
+    uint32_t rate;
+
+    rate = rate_detect_update(&inst->rate_detect, INPUT_CHUNK_FRAMES);
+    if (!rate) {
+        return;
+    }
+
+    printf("Input rate changed from %u to %u Hz\n", inst->input_rate, rate);
+    inst->input_rate = rate;
+
+    if (pa_simple_flush(pa_inst, &error) < 0) {
+        printf("Could not flush capture stream (error = %d)\n", error);
+    }
+
+    /* Anything that was scheduled to be skipped is gone now. */
+    inst->skip_chunks = 0;
+    inst->skip_burst_us = 0;
+
+    if (inst->state == IEC_60958_STATE_PCM) {
+        iec_60958_reset_lookahead(inst);
+        pcm_sink_close(&inst->pcm_sink);
+        pcm_sink_open(&inst->pcm_sink, inst->sink_latency_us, inst->input_rate);
+    }
+}
+#endif
+
+/* Sends a PCM chunk through the lookahead delay line. Chunks only get
+ * played once PCM_LOOKAHEAD_CHUNKS newer chunks have been scanned for
+ * IEC 61937 bursts, so if a bitstream starts, the chunks leading up
+ * to it can be dropped instead of being played as noise.
+ */
+static void iec_60958_process_pcm(struct iec_60958 *inst, uint8_t *chunk)
+{
+#if PCM_LOOKAHEAD_CHUNKS
+    uint8_t *slot;
+
+    if (inst->lookahead_count < PCM_LOOKAHEAD_CHUNKS) {
+        /* Still filling up. */
+        slot = inst->lookahead[(inst->lookahead_idx + inst->lookahead_count) % PCM_LOOKAHEAD_CHUNKS];
+        memcpy(slot, chunk, INPUT_CHUNK_SIZE);
+        inst->lookahead_count++;
+        return;
+    }
+
+    /* Play the oldest one and replace it with the new one. */
+    slot = inst->lookahead[inst->lookahead_idx];
+    iec_60958_play_pcm(inst, slot);
+    memcpy(slot, chunk, INPUT_CHUNK_SIZE);
+    inst->lookahead_idx = (inst->lookahead_idx + 1u) % PCM_LOOKAHEAD_CHUNKS;
+#else
+    iec_60958_play_pcm(inst, chunk);
+#endif
 }
 
 /* Processes a chunk of samples.
  * It is assumed that the array of bytes contains packed
- * 16 bit little endian samples.
+ * little endian samples of INPUT_SAMPLE_BYTES each.
  */
 static void iec_60958_process(struct iec_60958 *inst,
                               uint8_t *chunk,
@@ -132,59 +604,72 @@ static void iec_60958_process(struct iec_60958 *inst,
 {
     switch (inst->state) {
     case IEC_60958_STATE_UNKNOWN:
-        if (process_chunk_iec_61937(&inst->iec_61937_fsm_inst, chunk, chunk_size)) {
+        if (process_chunk_iec_61937(inst, chunk, chunk_size)) {
             /* Found an IEC 61937 stream.
              * NOTE: The call above may have caused some complete data burst
-             *       packets to be sent to the callback, but they will have
-             *       been dropped since the 61937 sink isn't actually open yet.
+             *       packets to be sent to the callback. Those were queued
+             *       since the 61937 sink isn't actually open yet, and get
+             *       replayed once it is.
              */
             printf("INIT: Found an IEC 61937 stream\n");
 
-            inst->non_61937_chunks = 0;
-            inst->state = IEC_60958_STATE_61937;
-
-            ac3_sink_open(&inst->ac3_sink, inst->sink_latency_us);
+            iec_60958_start_61937(inst);
         } else {
             inst->non_61937_chunks++;
             if (inst->non_61937_chunks >= IEC_61937_DETECTION_WINDOW) {
                 printf("INIT: Received %d chunks without a single IEC 61937 data burst; assuming PCM\n",
                        IEC_61937_DETECTION_WINDOW);
                 inst->state = IEC_60958_STATE_PCM;
+                inst->nr_pending = 0;
+                iec_60958_reset_lookahead(inst);
 
-                pcm_sink_open(&inst->pcm_sink, inst->sink_latency_us);
+                pcm_sink_open(&inst->pcm_sink, inst->sink_latency_us, inst->input_rate);
             }
         }
         break;
     case IEC_60958_STATE_PCM:
         /* Always check for IEC 61937 streams even while receiving PCM. */
-        if (process_chunk_iec_61937(&inst->iec_61937_fsm_inst, chunk, chunk_size)) {
+        if (process_chunk_iec_61937(inst, chunk, chunk_size)) {
             /* Going from PCM->61937... */
             printf("Found IEC 61937 stream; switching from PCM\n");
 
-            pcm_sink_close(&inst->pcm_sink);
+            /* Whatever is still in the lookahead led up to the burst,
+             * so it's most likely not audio. Just drop it.
+             */
+            iec_60958_reset_lookahead(inst);
 
-            inst->non_61937_chunks = 0;
-            inst->state = IEC_60958_STATE_61937;
+            pcm_sink_close(&inst->pcm_sink);
 
-            ac3_sink_open(&inst->ac3_sink, inst->sink_latency_us);
+            iec_60958_start_61937(inst);
         } else {
-            pcm_sink_process(&inst->pcm_sink, chunk);
+            iec_60958_process_pcm(inst, chunk);
         }
         break;
     case IEC_60958_STATE_61937:
-        if (process_chunk_iec_61937(&inst->iec_61937_fsm_inst, chunk, chunk_size)) {
+        if (process_chunk_iec_61937(inst, chunk, chunk_size)) {
             /* Got IEC 61937 data so reset counter. */
             inst->non_61937_chunks = 0;
         } else {
             inst->non_61937_chunks++;
-            if (inst->non_61937_chunks >= IEC_61937_DETECTION_WINDOW) {
-                printf("Received %d chunks without a single IEC 61937 data burst; switching to PCM\n",
-                       IEC_61937_DETECTION_WINDOW);
-                inst->state = IEC_60958_STATE_PCM;
+        }
 
-                ac3_sink_close(&inst->ac3_sink);
-                pcm_sink_open(&inst->pcm_sink, inst->sink_latency_us);
-            }
+        /* Keep up with any gap that's being filled with silence. */
+        compressed_sink_advance(&inst->compressed_sink,
+                                INPUT_CHUNK_FRAMES * (INPUT_BITSTREAM_CHANNELS / 2u),
+                                iec_60958_transport_rate(inst));
+
+        /* If the bursts have a known repetition period, the FSM can
+         * tell right away when they stop. Otherwise, fall back to the
+         * detection window.
+         */
+        if (iec_61937_fsm_missed_periods(&inst->iec_61937_fsm_inst) >= IEC_61937_MAX_MISSED_PERIODS) {
+            printf("Missed %u IEC 61937 data bursts in a row; switching to PCM\n",
+                   IEC_61937_MAX_MISSED_PERIODS);
+            iec_60958_fallback_pcm(inst);
+        } else if (inst->non_61937_chunks >= IEC_61937_DETECTION_WINDOW) {
+            printf("Received %d chunks without a single IEC 61937 data burst; switching to PCM\n",
+                   IEC_61937_DETECTION_WINDOW);
+            iec_60958_fallback_pcm(inst);
         }
         break;
     default:
@@ -193,27 +678,74 @@ static void iec_60958_process(struct iec_60958 *inst,
     }
 }
 
+/* Returns true if every channel in the map has a speaker position. */
+static bool channel_map_is_positional(const pa_channel_map *map)
+{
+    uint32_t i;
+
+    for (i = 0; i < map->channels; i++) {
+        if ((map->map[i] == PA_CHANNEL_POSITION_MONO) ||
+            ((map->map[i] >= PA_CHANNEL_POSITION_AUX0) && (map->map[i] <= PA_CHANNEL_POSITION_AUX31))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Get the channel map to record from the given source with. This is
+ * the source's own map if it has INPUT_CHANNELS channels. Otherwise,
+ * the server has to remix anyway, so the default order is used.
+ */
+static int get_capture_map(const char *source, pa_channel_map *map)
+{
+    int ret = -1;
+    struct pa_output output;
+
+    if (pa_output_connect(&output) == 0) {
+        ret = pa_output_get_source_map(&output, source, map);
+        pa_output_close(&output);
+    }
+
+    if ((ret == 0) && (map->channels == INPUT_CHANNELS)) {
+        return 0;
+    }
+
+    if (ret == 0) {
+        printf("Source %s has %u channels instead of %u; it will be remixed\n",
+               source,
+               map->channels,
+               INPUT_CHANNELS);
+#ifdef INPUT_HBR
+        printf("HBR streams won't survive that\n");
+#endif
+    }
+
+    return pa_output_channel_map(map, INPUT_CHANNELS);
+}
+
 int main(int argc, char*argv[])
 {
     int error;
     pa_simple *pa_inst;
     struct iec_60958 iec_60958_inst;
     pa_buffer_attr attr;
+    pa_channel_map channel_map;
+    const pa_channel_map *pcm_map;
     /* Keep the buffer in the BSS. */
     static uint8_t buffer[INPUT_CHUNK_SIZE];
 
-    /* Assume that the S/PDIF interface is always running at a 48 kHz sampling rate */
+    /* Assume that the S/PDIF interface is always running at the configured rate. */
     static const pa_sample_spec pa_ss = {
+#if INPUT_SAMPLE_BYTES == 4
+        .format = PA_SAMPLE_S32LE,
+#else
         .format = PA_SAMPLE_S16LE,
-        .rate = 48000,
-        .channels = 2
+#endif
+        .rate = INPUT_SAMPLE_RATE,
+        .channels = INPUT_CHANNELS
     };
 
-    static const pa_channel_map channel_map = {
-        .channels = 2,
-        .map[0] = PA_CHANNEL_POSITION_FRONT_LEFT,
-        .map[1] = PA_CHANNEL_POSITION_FRONT_RIGHT,
-    };
 
     if (argc < 2) {
         printf("Usage: audio_async_loopback [input name] [latency microsec]\n");
@@ -236,6 +768,22 @@ int main(int argc, char*argv[])
     attr.minreq = -1;
     attr.fragsize = INPUT_CHUNK_SIZE;
 
+    /* Record with the source's own channel map, so that the channels
+     * come through exactly as they were captured. With any other map,
+     * Pulseaudio remaps them (or remixes them, for a source with AUX
+     * positions), which scrambles a bitstream spread over more than
+     * one pair.
+     */
+    if (get_capture_map(argv[1], &channel_map) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Multichannel PCM is played with the same positions, unless the
+     * source doesn't say what they are, in which case they're taken to
+     * be in the default order.
+     */
+    pcm_map = channel_map_is_positional(&channel_map) ? &channel_map : NULL;
+
     /* Open simple pulseaudio context. */
     pa_inst = pa_simple_new(NULL,
                             PROGRAM_NAME_STR,
@@ -252,7 +800,9 @@ int main(int argc, char*argv[])
     }
 
     /* Open IEC 60958 handler. */
-    iec_60958_init(&iec_60958_inst);
+    if (iec_60958_init(&iec_60958_inst, pcm_map) < 0) {
+        return EXIT_FAILURE;
+    }
 
     iec_60958_inst.sink_latency_us = 0;
     if (argc == 3) {
@@ -262,13 +812,24 @@ int main(int argc, char*argv[])
         }
     }
 
+    printf("PCM lookahead is %u chunks (%u us of added latency)\n",
+           PCM_LOOKAHEAD_CHUNKS,
+           PCM_LOOKAHEAD_CHUNKS * iec_60958_chunk_us(&iec_60958_inst));
+
     /* Get sample chunks and process. */
     while (1) {
         if (pa_simple_read(pa_inst, buffer, sizeof(buffer), &error) < 0) {
             printf("Could not read sample chunk (error = %d)\n", error);
             return EXIT_FAILURE;
         }
+#ifdef RATE_DETECT
+        iec_60958_check_rate(&iec_60958_inst, pa_inst);
+#endif
+        iec_60958_check_backlog(&iec_60958_inst, pa_inst);
         iec_60958_process(&iec_60958_inst, buffer, sizeof(buffer));
+#ifdef PRINT_STATS
+        iec_60958_print_stats(&iec_60958_inst);
+#endif
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,462 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pulseaudio playback stream used by the sinks. This is basically the
+ * same thing that the pa_simple API does internally (a threaded main
+ * loop with a blocking write), but with access to the underlying
+ * stream so that things like the sample rate can be updated.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pa_output.h"
+#include "config.h"
+
+/* Returns the monotonic time in milliseconds. */
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000u) + (ts.tv_nsec / 1000000);
+}
+
+/* Context/stream callbacks. These all just wake up whoever
+ * is waiting on the main loop.
+ */
+static void context_state_cb(pa_context *c, void *userdata)
+{
+    struct pa_output *inst = (struct pa_output *)userdata;
+
+    pa_threaded_mainloop_signal(inst->mainloop, 0);
+}
+
+static void stream_state_cb(pa_stream *s, void *userdata)
+{
+    struct pa_output *inst = (struct pa_output *)userdata;
+
+    pa_threaded_mainloop_signal(inst->mainloop, 0);
+}
+
+static void stream_request_cb(pa_stream *s, size_t length, void *userdata)
+{
+    struct pa_output *inst = (struct pa_output *)userdata;
+
+    pa_threaded_mainloop_signal(inst->mainloop, 0);
+}
+
+static void stream_success_cb(pa_stream *s, int success, void *userdata)
+{
+    struct pa_output *inst = (struct pa_output *)userdata;
+
+    pa_threaded_mainloop_signal(inst->mainloop, 0);
+}
+
+/* Wait for an operation to complete. Must be called with the main loop locked. */
+static void wait_operation(struct pa_output *inst, pa_operation *op)
+{
+    if (!op) {
+        return;
+    }
+
+    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
+        pa_threaded_mainloop_wait(inst->mainloop);
+    }
+
+    pa_operation_unref(op);
+}
+
+/* Connect to the server. */
+int pa_output_connect(struct pa_output *inst)
+{
+    pa_context_state_t context_state;
+
+    memset(inst, 0, sizeof(struct pa_output));
+
+    inst->mainloop = pa_threaded_mainloop_new();
+    if (!inst->mainloop) {
+        printf("Could not create Pulseaudio main loop\n");
+        return -1;
+    }
+
+    inst->context = pa_context_new(pa_threaded_mainloop_get_api(inst->mainloop), PROGRAM_NAME_STR);
+    if (!inst->context) {
+        printf("Could not create Pulseaudio context\n");
+        goto fail;
+    }
+
+    pa_context_set_state_callback(inst->context, context_state_cb, inst);
+
+    if (pa_context_connect(inst->context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        printf("Could not connect to Pulseaudio (error = %d)\n", pa_context_errno(inst->context));
+        goto fail;
+    }
+
+    pa_threaded_mainloop_lock(inst->mainloop);
+
+    if (pa_threaded_mainloop_start(inst->mainloop) < 0) {
+        printf("Could not start Pulseaudio main loop\n");
+        goto fail_unlock;
+    }
+
+    /* Wait until the context is ready. */
+    while ((context_state = pa_context_get_state(inst->context)) != PA_CONTEXT_READY) {
+        if (!PA_CONTEXT_IS_GOOD(context_state)) {
+            printf("Pulseaudio context failed (error = %d)\n", pa_context_errno(inst->context));
+            goto fail_unlock;
+        }
+        pa_threaded_mainloop_wait(inst->mainloop);
+    }
+
+    pa_threaded_mainloop_unlock(inst->mainloop);
+
+    return 0;
+
+fail_unlock:
+    pa_threaded_mainloop_unlock(inst->mainloop);
+fail:
+    pa_output_close(inst);
+    return -1;
+}
+
+/* Sink info callback. Called once with the info, then again with eol set. */
+static void sink_info_cb(pa_context *c, const pa_sink_info *i, int eol, void *userdata)
+{
+    struct pa_output *inst = (struct pa_output *)userdata;
+
+    if (!eol && i) {
+        inst->sink_spec = i->sample_spec;
+        inst->sink_map = i->channel_map;
+        inst->have_sink_spec = true;
+    }
+
+    pa_threaded_mainloop_signal(inst->mainloop, 0);
+}
+
+/* Look up the default sink. */
+int pa_output_get_sink_spec(struct pa_output *inst, pa_sample_spec *ss, pa_channel_map *map)
+{
+    if (!inst->context) {
+        return -1;
+    }
+
+    pa_threaded_mainloop_lock(inst->mainloop);
+    inst->have_sink_spec = false;
+    wait_operation(inst, pa_context_get_sink_info_by_name(inst->context, "@DEFAULT_SINK@", sink_info_cb, inst));
+    pa_threaded_mainloop_unlock(inst->mainloop);
+
+    if (!inst->have_sink_spec) {
+        printf("Could not get default sink info (error = %d)\n", pa_context_errno(inst->context));
+        return -1;
+    }
+
+    if (ss) {
+        *ss = inst->sink_spec;
+    }
+
+    if (map) {
+        *map = inst->sink_map;
+    }
+
+    return 0;
+}
+
+/* Source info callback. Called once with the info, then again with eol set. */
+static void source_info_cb(pa_context *c, const pa_source_info *i, int eol, void *userdata)
+{
+    struct pa_output *inst = (struct pa_output *)userdata;
+
+    if (!eol && i) {
+        inst->source_map = i->channel_map;
+        inst->have_source_map = true;
+    }
+
+    pa_threaded_mainloop_signal(inst->mainloop, 0);
+}
+
+/* Look up a source by name. */
+int pa_output_get_source_map(struct pa_output *inst, const char *name, pa_channel_map *map)
+{
+    if (!inst->context) {
+        return -1;
+    }
+
+    pa_threaded_mainloop_lock(inst->mainloop);
+    inst->have_source_map = false;
+    wait_operation(inst, pa_context_get_source_info_by_name(inst->context, name, source_info_cb, inst));
+    pa_threaded_mainloop_unlock(inst->mainloop);
+
+    if (!inst->have_source_map) {
+        printf("Could not get info for source %s (error = %d)\n", name, pa_context_errno(inst->context));
+        return -1;
+    }
+
+    *map = inst->source_map;
+
+    return 0;
+}
+
+/* Find the rate to open the stream at. */
+uint32_t pa_output_native_rate(struct pa_output *inst, uint32_t rate)
+{
+    pa_sample_spec ss;
+
+    if (!inst->context && (pa_output_connect(inst) < 0)) {
+        return rate;
+    }
+
+    if ((pa_output_get_sink_spec(inst, &ss, NULL) < 0) || !ss.rate) {
+        return rate;
+    }
+
+    return ss.rate;
+}
+
+/* Open the stream. */
+int pa_output_open(struct pa_output *inst,
+                   const pa_sample_spec *ss,
+                   const pa_channel_map *map,
+                   const pa_buffer_attr *attr,
+                   bool variable_rate)
+{
+    pa_stream_state_t stream_state;
+    pa_stream_flags_t flags;
+
+    if (!inst->context && (pa_output_connect(inst) < 0)) {
+        return -1;
+    }
+
+    inst->variable_rate = variable_rate;
+    inst->nominal_rate = ss->rate;
+    inst->rate = ss->rate;
+
+    pa_threaded_mainloop_lock(inst->mainloop);
+
+    inst->stream = pa_stream_new(inst->context, "Audio Async Loopback", ss, map);
+    if (!inst->stream) {
+        printf("Could not create Pulseaudio stream (error = %d)\n", pa_context_errno(inst->context));
+        goto fail_unlock;
+    }
+
+    pa_stream_set_state_callback(inst->stream, stream_state_cb, inst);
+    pa_stream_set_write_callback(inst->stream, stream_request_cb, inst);
+
+    /* Same flags that pa_simple uses. */
+    flags = PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_ADJUST_LATENCY | PA_STREAM_AUTO_TIMING_UPDATE;
+    if (variable_rate) {
+        flags |= PA_STREAM_VARIABLE_RATE;
+    }
+
+    if (pa_stream_connect_playback(inst->stream, NULL, attr, flags, NULL, NULL) < 0) {
+        printf("Could not connect Pulseaudio stream (error = %d)\n", pa_context_errno(inst->context));
+        goto fail_unlock;
+    }
+
+    /* Wait until the stream is ready. */
+    while ((stream_state = pa_stream_get_state(inst->stream)) != PA_STREAM_READY) {
+        if (!PA_STREAM_IS_GOOD(stream_state)) {
+            printf("Pulseaudio stream failed (error = %d)\n", pa_context_errno(inst->context));
+            goto fail_unlock;
+        }
+        pa_threaded_mainloop_wait(inst->mainloop);
+    }
+
+    pa_threaded_mainloop_unlock(inst->mainloop);
+
+    return 0;
+
+fail_unlock:
+    pa_threaded_mainloop_unlock(inst->mainloop);
+    pa_output_close(inst);
+    return -1;
+}
+
+/* Close the stream. Safe to call on a partially opened stream. */
+void pa_output_close(struct pa_output *inst)
+{
+    if (inst->mainloop) {
+        pa_threaded_mainloop_stop(inst->mainloop);
+    }
+
+    if (inst->rate_op) {
+        pa_operation_unref(inst->rate_op);
+        inst->rate_op = NULL;
+    }
+
+    if (inst->stream) {
+        pa_stream_unref(inst->stream);
+        inst->stream = NULL;
+    }
+
+    if (inst->context) {
+        pa_context_disconnect(inst->context);
+        pa_context_unref(inst->context);
+        inst->context = NULL;
+    }
+
+    if (inst->mainloop) {
+        pa_threaded_mainloop_free(inst->mainloop);
+        inst->mainloop = NULL;
+    }
+}
+
+/* Build the channel map for the given channel count. */
+int pa_output_channel_map(pa_channel_map *map, uint32_t channels)
+{
+    static const pa_channel_position_t positions[] = {
+        PA_CHANNEL_POSITION_FRONT_LEFT,
+        PA_CHANNEL_POSITION_FRONT_RIGHT,
+        PA_CHANNEL_POSITION_FRONT_CENTER,
+        PA_CHANNEL_POSITION_LFE,
+        PA_CHANNEL_POSITION_REAR_LEFT,
+        PA_CHANNEL_POSITION_REAR_RIGHT,
+        PA_CHANNEL_POSITION_SIDE_LEFT,
+        PA_CHANNEL_POSITION_SIDE_RIGHT,
+    };
+    uint32_t i;
+
+    pa_channel_map_init(map);
+
+    switch (channels) {
+    case 2:
+    case 6:
+    case 8:
+        break;
+    default:
+        printf("No channel map for %u channels\n", channels);
+        return -1;
+    }
+
+    map->channels = channels;
+    for (i = 0; i < channels; i++) {
+        map->map[i] = positions[i];
+    }
+
+    return 0;
+}
+
+/* Write data to the stream, blocking until all of it is accepted. */
+int pa_output_write(struct pa_output *inst, const void *data, size_t bytes)
+{
+    size_t len;
+    const uint8_t *ptr = data;
+
+    if (!inst->stream) {
+        return -1;
+    }
+
+    pa_threaded_mainloop_lock(inst->mainloop);
+
+    while (bytes) {
+        while (!(len = pa_stream_writable_size(inst->stream))) {
+            pa_threaded_mainloop_wait(inst->mainloop);
+
+            if (!PA_STREAM_IS_GOOD(pa_stream_get_state(inst->stream))) {
+                goto fail;
+            }
+        }
+
+        if (len == (size_t)-1) {
+            goto fail;
+        }
+
+        if (len > bytes) {
+            len = bytes;
+        }
+
+        if (pa_stream_write(inst->stream, ptr, len, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+            goto fail;
+        }
+
+        ptr += len;
+        bytes -= len;
+    }
+
+    pa_threaded_mainloop_unlock(inst->mainloop);
+
+    return 0;
+
+fail:
+    pa_threaded_mainloop_unlock(inst->mainloop);
+    return -1;
+}
+
+/* Drop whatever is queued in the server. */
+void pa_output_flush(struct pa_output *inst)
+{
+    if (!inst->stream) {
+        return;
+    }
+
+    pa_threaded_mainloop_lock(inst->mainloop);
+    wait_operation(inst, pa_stream_flush(inst->stream, stream_success_cb, inst));
+    pa_threaded_mainloop_unlock(inst->mainloop);
+}
+
+/* Convert the ratio into a stream rate and send it to the server if
+ * the policy allows it.
+ * The ratio is output/input, so if it's > 1 the buffer is running low
+ * and the server needs to consume our samples more slowly, which means
+ * telling it that the stream rate is lower than nominal.
+ * The rate is an integer (about 20 PPM resolution at 48 kHz), but that's
+ * fine since the loop will just toggle between the two closest values.
+ */
+void pa_output_set_ratio(struct pa_output *inst, double ratio)
+{
+    uint64_t now;
+    uint32_t rate;
+
+    if (!inst->variable_rate || !inst->stream) {
+        return;
+    }
+
+    rate = (uint32_t)((inst->nominal_rate / ratio) + 0.5);
+    if (rate == inst->rate) {
+        return;
+    }
+
+    /* Limit how often we go over IPC. */
+    now = now_ms();
+    if ((now - inst->last_rate_update_ms) < DRIFT_COMP_SERVER_MIN_UPDATE_MS) {
+        return;
+    }
+
+    pa_threaded_mainloop_lock(inst->mainloop);
+
+    /* Don't queue up another update if the last one hasn't completed. */
+    if (inst->rate_op) {
+        if (pa_operation_get_state(inst->rate_op) == PA_OPERATION_RUNNING) {
+            pa_threaded_mainloop_unlock(inst->mainloop);
+            return;
+        }
+        pa_operation_unref(inst->rate_op);
+    }
+
+    inst->rate_op = pa_stream_update_sample_rate(inst->stream, rate, NULL, NULL);
+    if (inst->rate_op) {
+        inst->rate = rate;
+        inst->last_rate_update_ms = now;
+        inst->rate_updates++;
+    }
+
+    pa_threaded_mainloop_unlock(inst->mainloop);
+}
@@ -0,0 +1,109 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PA_OUTPUT_H_
+#define _PA_OUTPUT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pulse/pulseaudio.h>
+
+#include "config.h"
+
+struct pa_output {
+    pa_threaded_mainloop *mainloop;
+    pa_context *context;
+    pa_stream *stream;
+
+    /* Only used with variable rate streams. */
+    bool variable_rate;
+    uint32_t nominal_rate;
+    uint32_t rate;
+    uint64_t last_rate_update_ms;
+    pa_operation *rate_op;
+    uint32_t rate_updates;
+
+    /* Default sink info, filled in by pa_output_get_sink_spec(). */
+    bool have_sink_spec;
+    pa_sample_spec sink_spec;
+    pa_channel_map sink_map;
+
+    /* Source info, filled in by pa_output_get_source_map(). */
+    bool have_source_map;
+    pa_channel_map source_map;
+};
+
+/* Connect to the server. This is done by pa_output_open() if needed,
+ * but can be done ahead of time to look at the sink before deciding
+ * on the stream format. Returns 0 on success.
+ */
+int pa_output_connect(struct pa_output *inst);
+
+/* Look up the sample spec and channel map of the default sink. Must be
+ * connected. Returns 0 on success.
+ */
+int pa_output_get_sink_spec(struct pa_output *inst, pa_sample_spec *ss, pa_channel_map *map);
+
+/* Look up the channel map of the named source. Must be connected.
+ * Returns 0 on success.
+ */
+int pa_output_get_source_map(struct pa_output *inst, const char *name, pa_channel_map *map);
+
+/* Returns the rate that the default sink is running at, so that the
+ * stream can be opened at that rate and the server doesn't have to
+ * resample it. Connects if needed. If the sink can't be looked up,
+ * the given rate is returned instead.
+ */
+uint32_t pa_output_native_rate(struct pa_output *inst, uint32_t rate);
+
+/* Open a playback stream on the default sink. This behaves like
+ * pa_simple_new(), except that if variable_rate is set, the
+ * stream is opened with PA_STREAM_VARIABLE_RATE so that the
+ * sample rate can be changed on the fly. Connects first unless
+ * pa_output_connect() was already called, so the struct has to be
+ * either connected, zeroed, or closed.
+ * Returns 0 on success.
+ */
+int pa_output_open(struct pa_output *inst,
+                   const pa_sample_spec *ss,
+                   const pa_channel_map *map,
+                   const pa_buffer_attr *attr,
+                   bool variable_rate);
+
+void pa_output_close(struct pa_output *inst);
+
+/* Fill in the channel map that goes with a plain channel count
+ * (stereo, 5.1 or 7.1, in the usual FL, FR, FC, LFE, RL, RR, SL, SR
+ * order). Returns 0 on success.
+ */
+int pa_output_channel_map(pa_channel_map *map, uint32_t channels);
+
+/* Blocking write, just like pa_simple_write(). Returns 0 on success. */
+int pa_output_write(struct pa_output *inst, const void *data, size_t bytes);
+
+void pa_output_flush(struct pa_output *inst);
+
+/* Apply a sampling rate ratio (output/input, as would be given to the
+ * resampler) to a variable rate stream. The update is rate limited
+ * (see DRIFT_COMP_SERVER_MIN_UPDATE_MS) and only sent to the server
+ * when the rounded rate actually changes.
+ */
+void pa_output_set_ratio(struct pa_output *inst, double ratio);
+
+
+#endif /* _PA_OUTPUT_H_ */
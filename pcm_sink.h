@@ -20,21 +20,26 @@
 
 #include <stdint.h>
 #include <stddef.h>
-#include <stdbool.h>
-#include <pthread.h>
-#include <samplerate.h>
-#include <pulse/simple.h>
 
 #include "config.h"
+#include "sink_core.h"
 
 struct pcm_sink {
-    pthread_mutex_t lock;
-    pthread_t thread;
-    pthread_cond_t cond;
-    bool thread_run;
+    struct sink_core core;
 
-    SRC_STATE *rate_converter;
-    pa_simple *pa_inst;
+    /* The ring buffer holds PCM_SINK_SAMPLE_BUFFER_SIZE samples. The
+     * output of the drift compensation can actually be larger than
+     * the input. For example, if the ratio is >2. The drift part of
+     * the ratio is limited to like 1.1, but the output can also be at
+     * the sink's rate, so leave room for something like 44.1k in and
+     * 192k out. The time stretcher can hold on to a few periods and
+     * then let them all go at once, so leave plenty of room for that
+     * too.
+     */
+    SINK_CORE_STORAGE(PCM_SINK_SAMPLE_BUFFER_SIZE,
+                      PCM_SINK_OUTPUT_CHUNK_SIZE,
+                      INPUT_CHUNK_SIZE * 3,
+                      TIME_STRETCH_BUF_FRAMES * PCM_SINK_CHANNELS) storage;
 
     /* The input buffer is basically a chunk but converted from
      * int16_t to float. So, chunk size is 128 bytes, which is 64 samples,
@@ -42,30 +47,27 @@ struct pcm_sink {
      */
     float tmp_input_buf[INPUT_CHUNK_SIZE / 2];
 
-    /* The output can actually be larger than the input. For example,
-     * if the ratio is >2. Our ratio is limited to like 1.1, but let's
-     * just use double the buffer. This would leave room for something like
-     * 48k in and 96k out.
-     */
-    float tmp_output_buf[INPUT_CHUNK_SIZE];
-
-    float buffer[PCM_SINK_SAMPLE_BUFFER_SIZE];
-    uint32_t read_idx;
-    uint32_t write_idx;
-
-    SRC_DATA src_data;
-
-    int32_t history[PCM_SINK_BUFFER_HIST_SIZE];
-    uint32_t histidx;
-    int32_t average; /* Informational only */
+    pa_channel_map channel_map;
 };
 
-void pcm_sink_open(struct pcm_sink *inst, uint32_t latency_us);
+/* Set up the sink. This only needs to be called once, and the sink can
+ * then be opened and closed any number of times. The channels are
+ * played with the given map, or in the default order if it's NULL.
+ * Returns 0 on success.
+ */
+int pcm_sink_init(struct pcm_sink *inst, const pa_channel_map *map);
+
+/* Open the sink for PCM at the given sampling rate. */
+void pcm_sink_open(struct pcm_sink *inst, uint32_t latency_us, uint32_t rate);
 
 void pcm_sink_close(struct pcm_sink *inst);
 
-/* Data is a pointer to interleaved left/right 16 bit samples. */
-void pcm_sink_process(struct pcm_sink *inst, uint8_t *data);
+void pcm_sink_get_stats(struct pcm_sink *inst, struct sink_core_stats *stats);
+
+/* Data is a pointer to interleaved samples (INPUT_SAMPLE_BYTES each, with
+ * PCM_SINK_CHANNELS per frame).
+ */
+void pcm_sink_process(struct pcm_sink *inst, uint8_t *data, size_t len);
 
 
 #endif /* _PCM_SINK_H_ */
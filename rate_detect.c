@@ -0,0 +1,142 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Input sample rate detection. S/PDIF receivers usually run off of a
+ * clock recovered from the incoming signal, so when the source
+ * switches from 48 kHz to 44.1 kHz (for example), the capture device
+ * just starts delivering frames more slowly while the stream is still
+ * labelled with the old rate. Everything downstream then plays the
+ * audio at the wrong pitch.
+ * Since the capture reads block until the data is there, the rate that
+ * the frames actually show up at can be measured against the monotonic
+ * clock. That's compared against the standard rates, and once a few
+ * windows in a row agree on a different one, it's reported as a change.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "rate_detect.h"
+#include "config.h"
+
+static const uint32_t standard_rates[] = {
+    32000, 44100, 48000, 88200, 96000, 176400, 192000
+};
+
+/* Returns the monotonic time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000u) + ts.tv_nsec;
+}
+
+/* Returns the standard rate that the measured one is close to, or 0
+ * if it isn't close to any of them.
+ */
+static uint32_t nearest_standard_rate(double rate)
+{
+    uint32_t i;
+
+    for (i = 0; i < (sizeof(standard_rates) / sizeof(standard_rates[0])); i++) {
+        if (fabs(rate - standard_rates[i]) <= (standard_rates[i] * (RATE_DETECT_TOLERANCE_PERCENT / 100.0))) {
+            return standard_rates[i];
+        }
+    }
+
+    return 0;
+}
+
+/* Initialize. */
+void rate_detect_init(struct rate_detect *inst, uint32_t rate)
+{
+    memset(inst, 0, sizeof(struct rate_detect));
+
+    inst->rate = rate;
+    inst->measured_rate = rate;
+}
+
+/* Start over with a new window. */
+void rate_detect_reset(struct rate_detect *inst)
+{
+    inst->window_start_ns = 0;
+    inst->window_frames = 0;
+    inst->candidate = 0;
+    inst->candidate_windows = 0;
+}
+
+/* Add some frames to the current window, and check the rate once
+ * the window is complete.
+ */
+uint32_t rate_detect_update(struct rate_detect *inst, uint32_t nr_frames)
+{
+    uint32_t rate;
+    uint64_t elapsed_ns;
+    const uint64_t now = now_ns();
+
+    if (!inst->window_start_ns) {
+        /* The frames that were just read arrived before now, so the
+         * window starts here and they don't count.
+         */
+        inst->window_start_ns = now;
+        inst->window_frames = 0;
+        return 0;
+    }
+
+    inst->window_frames += nr_frames;
+
+    elapsed_ns = now - inst->window_start_ns;
+    if (elapsed_ns < (RATE_DETECT_WINDOW_MS * 1000000ull)) {
+        return 0;
+    }
+
+    inst->measured_rate = (inst->window_frames * 1000000000.0) / elapsed_ns;
+    inst->window_start_ns = now;
+    inst->window_frames = 0;
+
+    rate = nearest_standard_rate(inst->measured_rate);
+    if (!rate || (rate == inst->rate)) {
+        /* Either nothing changed, or the input stalled or caught up on
+         * a backlog in the middle of the window. Either way, start over.
+         */
+        inst->candidate = 0;
+        inst->candidate_windows = 0;
+        return 0;
+    }
+
+    if (rate != inst->candidate) {
+        inst->candidate = rate;
+        inst->candidate_windows = 0;
+    }
+
+    inst->candidate_windows++;
+    if (inst->candidate_windows < RATE_DETECT_CONFIRM_WINDOWS) {
+        return 0;
+    }
+
+    inst->rate = rate;
+    inst->changes++;
+    rate_detect_reset(inst);
+
+    return rate;
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RATE_DETECT_H_
+#define _RATE_DETECT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+struct rate_detect {
+    /* Rate that the input is currently assumed to be running at. */
+    uint32_t rate;
+
+    /* Current measurement window. */
+    uint64_t window_start_ns;
+    uint64_t window_frames;
+
+    /* Standard rate that the last few windows matched, and how many
+     * windows in a row it's been.
+     */
+    uint32_t candidate;
+    uint32_t candidate_windows;
+
+    /* Rate measured over the last complete window. */
+    double measured_rate;
+    uint32_t changes;
+};
+
+/* Initialize, assuming that the input starts out at the given rate. */
+void rate_detect_init(struct rate_detect *inst, uint32_t rate);
+
+/* Restart the measurement, like after a gap in the input. */
+void rate_detect_reset(struct rate_detect *inst);
+
+/* Account for nr_frames that were just read from the input. Returns
+ * the new rate if the input has switched to a different one, or 0.
+ */
+uint32_t rate_detect_update(struct rate_detect *inst, uint32_t nr_frames);
+
+
+#endif /* _RATE_DETECT_H_ */
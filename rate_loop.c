@@ -0,0 +1,410 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Buffer utilization control loop shared by the sinks. Each time a
+ * chunk is about to be added to a sink's ring buffer, the current
+ * utilization is passed in and a new sampling rate ratio is returned.
+ * The ratio is proportional to the averaged offset from the target
+ * utilization.
+ * The loop has two "gears". The fast gear uses a larger gain and a
+ * shorter averaging window so that it locks quickly after the sink is
+ * opened or after a disturbance. Once locked, it switches to the slow
+ * gear, which uses the configured (tiny) gain so that the pitch changes
+ * remain inaudible.
+ * Optionally, the target utilization itself can be adapted to the
+ * amount of jitter that is actually observed on the system.
+ * There's also a simple delay locked loop (like the one used by JACK)
+ * for measuring the actual rate of a stream from its timestamps.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "rate_loop.h"
+#include "config.h"
+
+/* Returns the monotonic time in milliseconds. */
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000u) + (ts.tv_nsec / 1000000);
+}
+
+/* Returns the gain for the given gear. */
+static double gear_gain(struct rate_loop *inst, enum rate_loop_gear gear)
+{
+    if (gear == RATE_LOOP_GEAR_FAST) {
+        return inst->gain * RATE_LOOP_FAST_GAIN_MULT;
+    }
+
+    return inst->gain;
+}
+
+/* Returns the averaged offset for the given gear. */
+static double gear_average(struct rate_loop *inst, enum rate_loop_gear gear)
+{
+    if (gear == RATE_LOOP_GEAR_FAST) {
+        return (double)inst->fast_sum / inst->fast_hist_size;
+    }
+
+    return (double)inst->sum / inst->hist_size;
+}
+
+/* Add an observation to a jitter histogram. Negative values
+ * (i.e., early instead of late) are counted as zero.
+ */
+static void jitter_add(struct rate_loop_jitter *jitter, int32_t value)
+{
+    uint32_t bucket;
+
+    if (value < 0) {
+        value = 0;
+    }
+
+    bucket = value / jitter->bucket_width;
+    if (bucket >= RATE_LOOP_JITTER_BUCKETS) {
+        bucket = RATE_LOOP_JITTER_BUCKETS - 1u;
+    }
+
+    jitter->counts[bucket]++;
+    jitter->total++;
+}
+
+/* Halve all of the counts so that old observations slowly fade out. */
+static void jitter_decay(struct rate_loop_jitter *jitter)
+{
+    size_t i;
+
+    jitter->total = 0;
+    for (i = 0; i < RATE_LOOP_JITTER_BUCKETS; i++) {
+        jitter->counts[i] >>= 1u;
+        jitter->total += jitter->counts[i];
+    }
+}
+
+/* Returns the smallest value (rounded up to a bucket edge) that at most
+ * a "budget" fraction of the observations exceeded.
+ */
+static int32_t jitter_percentile(struct rate_loop_jitter *jitter, double budget)
+{
+    size_t i;
+    uint32_t accum;
+    const double allowed = budget * jitter->total;
+
+    accum = 0;
+    for (i = RATE_LOOP_JITTER_BUCKETS; i > 0; i--) {
+        accum += jitter->counts[i - 1u];
+        if (accum > allowed) {
+            return i * jitter->bucket_width;
+        }
+    }
+
+    return 0;
+}
+
+/* Move the target towards the smallest value that covers the
+ * measured jitter. The two jitter sources are assumed to be
+ * independent, so they're combined as a root sum of squares.
+ * Must only be called periodically since it walks the histograms.
+ */
+static void update_target(struct rate_loop *inst)
+{
+    double required;
+    int32_t wanted;
+    int32_t max_step;
+    const double exc = jitter_percentile(&inst->excursion, RATE_LOOP_UNDERRUN_BUDGET);
+    const double jit = jitter_percentile(&inst->wakeup_jitter, RATE_LOOP_UNDERRUN_BUDGET);
+
+    if (inst->excursion.total < RATE_LOOP_JITTER_MIN_SAMPLES) {
+        return;
+    }
+
+    required = sqrt((exc * exc) + (jit * jit));
+    wanted = inst->min_target + (int32_t)required;
+
+    if (wanted > inst->max_target) {
+        wanted = inst->max_target;
+    }
+
+    /* Limit the step size so that the change in offset can't
+     * make the loop think that it lost lock.
+     */
+    max_step = (inst->target * RATE_LOOP_TARGET_STEP_PERCENT) / 100;
+    if (max_step < 1) {
+        max_step = 1;
+    }
+
+    if (wanted > (inst->target + max_step)) {
+        wanted = inst->target + max_step;
+    } else if (wanted < (inst->target - max_step)) {
+        wanted = inst->target - max_step;
+    }
+
+    inst->target = wanted;
+}
+
+/* Switch gears. The bias is recalculated so that the drift
+ * correction that the loop had settled on isn't lost.
+ * When stepping down, the ratio before and after the switch is kept
+ * the same. Without this, there would be a step in the ratio since
+ * the steady state offset of the two gears is different.
+ * When stepping up, the current average is not folded in since the
+ * whole point is to react to it as fast as possible.
+ */
+static void shift_gear(struct rate_loop *inst, enum rate_loop_gear gear)
+{
+    const double correction = gear_gain(inst, inst->gear) *
+                              (gear_average(inst, inst->gear) + inst->bias);
+
+    inst->bias = correction / gear_gain(inst, gear);
+    if (gear == RATE_LOOP_GEAR_SLOW) {
+        inst->bias -= gear_average(inst, gear);
+    }
+    inst->gear = gear;
+    inst->gear_shifts++;
+}
+
+/* Initialize the loop. */
+void rate_loop_init(struct rate_loop *inst,
+                    int32_t target,
+                    double gain,
+                    uint32_t hist_size)
+{
+    memset(inst, 0, sizeof(struct rate_loop));
+
+    inst->target = target;
+    inst->gain = gain;
+    inst->hist_size = hist_size;
+    inst->fast_hist_size = hist_size / RATE_LOOP_FAST_HIST_DIV;
+    if (!inst->fast_hist_size) {
+        inst->fast_hist_size = 1;
+    }
+
+    inst->gear = RATE_LOOP_GEAR_FAST;
+    inst->locked = false;
+    inst->open_time_ms = now_ms();
+    inst->ratio = 1.0;
+}
+
+/* Enable the adaptive target. */
+void rate_loop_enable_adaptive_target(struct rate_loop *inst,
+                                      int32_t min_target,
+                                      int32_t max_target,
+                                      uint32_t bucket_width)
+{
+    inst->adaptive = true;
+    inst->min_target = min_target;
+    inst->max_target = max_target;
+    inst->excursion.bucket_width = bucket_width;
+    inst->wakeup_jitter.bucket_width = bucket_width;
+    inst->last_target_update_ms = inst->open_time_ms;
+    inst->last_decay_ms = inst->open_time_ms;
+}
+
+/* Record a consumer wakeup. Must be called with the same
+ * lock held that protects the update call.
+ */
+void rate_loop_add_wakeup_jitter(struct rate_loop *inst, int32_t late_samples)
+{
+    if (inst->adaptive) {
+        jitter_add(&inst->wakeup_jitter, late_samples);
+    }
+}
+
+/* Calculate a new sampling rate ratio. This should be called
+ * before adding a new chunk to the ring buffer.
+ */
+double rate_loop_update(struct rate_loop *inst, uint32_t buffer_used)
+{
+    uint64_t now;
+    int32_t abs_fast_avg;
+    const uint32_t mask = RATE_LOOP_MAX_HIST_SIZE - 1u;
+    const int32_t tmp = buffer_used;
+    int32_t offset = inst->target - tmp;
+
+    /* Clamp the max offset so that the max rate ratio is
+     * purely limited by the gain.
+     */
+    if (offset < -inst->target) {
+        offset = -inst->target;
+    } else if (offset > inst->target) {
+        offset = inst->target;
+    }
+
+    /* Both windows end at the newest entry, so just subtract
+     * whatever is falling out of each one.
+     */
+    inst->sum -= inst->history[(inst->histidx - inst->hist_size) & mask];
+    inst->fast_sum -= inst->history[(inst->histidx - inst->fast_hist_size) & mask];
+    inst->history[inst->histidx & mask] = offset;
+    inst->sum += offset;
+    inst->fast_sum += offset;
+    inst->histidx++;
+
+    /* Lock detection always uses the short window so that
+     * disturbances are noticed quickly, even in the slow gear.
+     */
+    now = now_ms();
+    abs_fast_avg = inst->fast_sum / (int32_t)inst->fast_hist_size;
+    if (abs_fast_avg < 0) {
+        abs_fast_avg = -abs_fast_avg;
+    }
+
+    if (inst->gear == RATE_LOOP_GEAR_FAST) {
+        if ((abs_fast_avg * 100) <= (inst->target * RATE_LOOP_LOCK_PERCENT)) {
+            if (!inst->in_window) {
+                inst->in_window = true;
+                inst->in_window_since_ms = now;
+            }
+        } else {
+            inst->in_window = false;
+        }
+
+        if (inst->in_window &&
+            ((now - inst->open_time_ms) >= RATE_LOOP_STARTUP_MS) &&
+            ((now - inst->in_window_since_ms) >= RATE_LOOP_LOCK_HOLD_MS)) {
+            shift_gear(inst, RATE_LOOP_GEAR_SLOW);
+            inst->locked = true;
+        }
+    } else if ((abs_fast_avg * 100) > (inst->target * RATE_LOOP_UNLOCK_PERCENT)) {
+        /* Lost lock. */
+        shift_gear(inst, RATE_LOOP_GEAR_FAST);
+        inst->locked = false;
+        inst->in_window = false;
+    }
+
+    if (inst->gear == RATE_LOOP_GEAR_SLOW) {
+        inst->bias += (double)offset / (inst->hist_size * RATE_LOOP_INTEGRAL_MULT);
+    }
+
+    if (inst->adaptive) {
+        /* How far below the long term average level the buffer is
+         * right now. This is what would have to be covered by the
+         * target to avoid an underrun.
+         */
+        jitter_add(&inst->excursion,
+                   (inst->target - tmp) - (int32_t)(inst->sum / (int32_t)inst->hist_size));
+
+        if ((now - inst->last_decay_ms) >= RATE_LOOP_JITTER_DECAY_MS) {
+            inst->last_decay_ms = now;
+            jitter_decay(&inst->excursion);
+            jitter_decay(&inst->wakeup_jitter);
+        }
+
+        if ((now - inst->last_target_update_ms) >= RATE_LOOP_TARGET_UPDATE_MS) {
+            inst->last_target_update_ms = now;
+            update_target(inst);
+        }
+    }
+
+    inst->average = gear_average(inst, inst->gear);
+    inst->ratio = (gear_gain(inst, inst->gear) *
+                   (gear_average(inst, inst->gear) + inst->bias)) + 1.0;
+
+    return inst->ratio;
+}
+
+/* Initialize a DLL. */
+void rate_loop_dll_init(struct rate_loop_dll *dll, double nominal_rate)
+{
+    memset(dll, 0, sizeof(struct rate_loop_dll));
+
+    dll->nominal_period = 1.0 / nominal_rate;
+    dll->period = dll->nominal_period;
+    dll->started = false;
+}
+
+/* Update a DLL. This is a second order loop where the error is the
+ * difference between when the event was predicted to happen (based
+ * on the number of frames and the current period estimate) and when
+ * it actually happened. The loop bandwidth is scaled by the duration
+ * of each event so that it's the same regardless of how many frames
+ * are passed in at a time.
+ */
+void rate_loop_dll_update(struct rate_loop_dll *dll, uint32_t frames, uint64_t now_ns)
+{
+    double predicted;
+    double err;
+    double omega;
+    const double now = now_ns / 1000000000.0;
+
+    if (!dll->started || !frames) {
+        dll->next = now;
+        dll->started = true;
+        return;
+    }
+
+    predicted = dll->next + (dll->period * frames);
+    err = now - predicted;
+
+    /* If the error is way off, just resync the time instead of
+     * letting it slowly slew back (e.g., after a long stall).
+     */
+    if ((err > RATE_LOOP_DLL_RESYNC_SEC) || (err < -RATE_LOOP_DLL_RESYNC_SEC)) {
+        dll->next = now;
+        return;
+    }
+
+    omega = 2.0 * M_PI * RATE_LOOP_DLL_BANDWIDTH * (dll->period * frames);
+
+    dll->next = predicted + (M_SQRT2 * omega * err);
+    dll->period += (omega * omega * err) / frames;
+
+    /* Don't let a long stall drag the estimate somewhere crazy. */
+    if (dll->period > (dll->nominal_period * (1.0 + RATE_LOOP_DLL_MAX_DEVIATION))) {
+        dll->period = dll->nominal_period * (1.0 + RATE_LOOP_DLL_MAX_DEVIATION);
+    } else if (dll->period < (dll->nominal_period * (1.0 - RATE_LOOP_DLL_MAX_DEVIATION))) {
+        dll->period = dll->nominal_period * (1.0 - RATE_LOOP_DLL_MAX_DEVIATION);
+    }
+}
+
+/* Returns the estimated rate of a DLL. */
+double rate_loop_dll_rate(struct rate_loop_dll *dll)
+{
+    return 1.0 / dll->period;
+}
+
+/* Copy out the loop statistics. */
+void rate_loop_get_stats(struct rate_loop *inst, struct rate_loop_stats *stats)
+{
+    stats->locked = inst->locked;
+    stats->gear = inst->gear;
+    stats->ratio = inst->ratio;
+    stats->average = inst->average;
+    stats->gear_shifts = inst->gear_shifts;
+    stats->target = inst->target;
+    stats->excursion = jitter_percentile(&inst->excursion, RATE_LOOP_UNDERRUN_BUDGET);
+    stats->wakeup_jitter = jitter_percentile(&inst->wakeup_jitter, RATE_LOOP_UNDERRUN_BUDGET);
+}
+
+/* Returns a printable name for a gear. */
+const char *rate_loop_gear_str(enum rate_loop_gear gear)
+{
+    switch (gear) {
+    case RATE_LOOP_GEAR_FAST:
+        return "fast";
+    case RATE_LOOP_GEAR_SLOW:
+        return "slow";
+    }
+
+    return "unknown";
+}
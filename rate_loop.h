@@ -0,0 +1,140 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RATE_LOOP_H_
+#define _RATE_LOOP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+enum rate_loop_gear {
+    /* High gain, short averaging window. Used until locked. */
+    RATE_LOOP_GEAR_FAST,
+    /* Normal (low) gain, long averaging window. */
+    RATE_LOOP_GEAR_SLOW,
+};
+
+/* Decaying histogram used to estimate a high percentile of a
+ * jitter measurement (in samples).
+ */
+struct rate_loop_jitter {
+    uint32_t bucket_width;
+    uint32_t counts[RATE_LOOP_JITTER_BUCKETS];
+    uint32_t total;
+};
+
+/* Delay locked loop used to estimate the actual rate of a
+ * stream of frames from the times at which they arrive.
+ */
+struct rate_loop_dll {
+    double nominal_period;
+    double period; /* Estimated seconds per frame */
+    double next; /* Filtered time of the latest event */
+    bool started;
+};
+
+struct rate_loop_stats {
+    bool locked;
+    enum rate_loop_gear gear;
+    double ratio;
+    int32_t average;
+    uint32_t gear_shifts;
+    int32_t target;
+    int32_t excursion; /* Percentile of level dips, in samples */
+    int32_t wakeup_jitter; /* Percentile of consumer lateness, in samples */
+};
+
+struct rate_loop {
+    /* Parameters. */
+    int32_t target;
+    double gain;
+    uint32_t hist_size;
+    uint32_t fast_hist_size;
+
+    int32_t history[RATE_LOOP_MAX_HIST_SIZE];
+    uint32_t histidx;
+    int64_t sum;
+    int64_t fast_sum;
+
+    /* Offset added to the averaged error. Carries the drift correction
+     * across gear shifts and is slowly integrated while locked.
+     */
+    double bias;
+
+    enum rate_loop_gear gear;
+    bool locked;
+    uint64_t open_time_ms;
+    uint64_t in_window_since_ms;
+    bool in_window;
+
+    int32_t average; /* Informational only */
+    double ratio;
+    uint32_t gear_shifts;
+
+    /* Adaptive target. */
+    bool adaptive;
+    int32_t min_target;
+    int32_t max_target;
+    struct rate_loop_jitter excursion;
+    struct rate_loop_jitter wakeup_jitter;
+    uint64_t last_target_update_ms;
+    uint64_t last_decay_ms;
+};
+
+/* Hist size must be a power of 2 and <= RATE_LOOP_MAX_HIST_SIZE. */
+void rate_loop_init(struct rate_loop *inst,
+                    int32_t target,
+                    double gain,
+                    uint32_t hist_size);
+
+/* Let the target move between min and max based on the measured
+ * jitter. Bucket width is the jitter histogram resolution in samples.
+ */
+void rate_loop_enable_adaptive_target(struct rate_loop *inst,
+                                      int32_t min_target,
+                                      int32_t max_target,
+                                      uint32_t bucket_width);
+
+/* Record how late (in samples) the consumer woke up relative to
+ * when it was expected to.
+ */
+void rate_loop_add_wakeup_jitter(struct rate_loop *inst, int32_t late_samples);
+
+/* Returns the new sampling rate ratio given the current buffer utilization. */
+double rate_loop_update(struct rate_loop *inst, uint32_t buffer_used);
+
+/* Initialize a rate estimator for a stream with the given nominal rate (in frames/sec). */
+void rate_loop_dll_init(struct rate_loop_dll *dll, double nominal_rate);
+
+/* Update a rate estimator. Frames is the number of frames that were
+ * produced or consumed since the previous call, and now_ns is the
+ * (monotonic) time at which that happened.
+ */
+void rate_loop_dll_update(struct rate_loop_dll *dll, uint32_t frames, uint64_t now_ns);
+
+/* Returns the estimated rate in frames/sec. */
+double rate_loop_dll_rate(struct rate_loop_dll *dll);
+
+void rate_loop_get_stats(struct rate_loop *inst, struct rate_loop_stats *stats);
+
+const char *rate_loop_gear_str(enum rate_loop_gear gear);
+
+
+#endif /* _RATE_LOOP_H_ */
@@ -0,0 +1,297 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drift compensating resampler used by the sinks in DRIFT_COMP_SRC mode.
+ * This is mostly a wrapper around libsamplerate, but when the input and
+ * output turn out to be on the same clock (i.e., the ratio just sits at
+ * 1.0), it bypasses the converter entirely and copies the samples
+ * straight through, which saves CPU and keeps the audio bit-perfect.
+ * The direct path is delayed by the converter's own latency so that
+ * the two paths are time aligned, which allows switching between them
+ * with a short crossfade and no change in the buffer level.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "resampler.h"
+#include "config.h"
+
+#define RESAMPLER_HISTORY_MASK         (RESAMPLER_HISTORY_FRAMES - 1u)
+
+/* Frames fed to the converter per call while priming. */
+#define RESAMPLER_PRIME_CHUNK          256u
+
+/* Returns a pointer to the frame at the given position in the history. */
+static float *history_frame(struct resampler *inst, uint32_t pos)
+{
+    return &inst->history[(pos & RESAMPLER_HISTORY_MASK) * inst->channels];
+}
+
+/* Run some frames through the converter. Returns the number of output frames. */
+static size_t convert(struct resampler *inst,
+                      const float *in,
+                      size_t in_frames,
+                      float *out,
+                      size_t out_frames,
+                      double ratio)
+{
+    int error;
+
+    inst->src_data.data_in = in;
+    inst->src_data.input_frames = in_frames;
+    inst->src_data.data_out = out;
+    inst->src_data.output_frames = out_frames;
+    inst->src_data.src_ratio = ratio;
+
+    if ((error = src_process(inst->src, &inst->src_data))) {
+        printf("Rate converter error %s\n",  src_strerror(error));
+        return 0;
+    }
+
+    return inst->src_data.output_frames_gen;
+}
+
+/* Reset the converter and run the last RESAMPLER_PRIME_FRAMES of input
+ * through it (discarding the output) so that its internal state is the
+ * same as if it had been running all along.
+ * Returns the number of frames that it produced.
+ */
+static size_t prime(struct resampler *inst)
+{
+    size_t n;
+    size_t produced;
+    uint32_t remaining;
+    uint32_t pos;
+    float scratch[(RESAMPLER_PRIME_CHUNK * 2u) * RESAMPLER_MAX_CHANNELS];
+
+    src_reset(inst->src);
+
+    produced = 0;
+    pos = inst->in_pos - RESAMPLER_PRIME_FRAMES;
+    remaining = RESAMPLER_PRIME_FRAMES;
+
+    while (remaining) {
+        /* Don't cross the end of the history array. */
+        n = RESAMPLER_HISTORY_FRAMES - (pos & RESAMPLER_HISTORY_MASK);
+        if (n > RESAMPLER_PRIME_CHUNK) {
+            n = RESAMPLER_PRIME_CHUNK;
+        }
+        if (n > remaining) {
+            n = remaining;
+        }
+
+        produced += convert(inst, history_frame(inst, pos), n, scratch, RESAMPLER_PRIME_CHUNK * 2u, 1.0);
+
+        pos += n;
+        remaining -= n;
+    }
+
+    return produced;
+}
+
+/* Returns true if the ratio has been close enough to 1.0 for long
+ * enough to use the passthrough path.
+ */
+static bool passthrough_wanted(struct resampler *inst, double ratio, size_t in_frames)
+{
+    double ppm = (ratio - 1.0) * 1000000.0;
+
+    if (ppm < 0) {
+        ppm = -ppm;
+    }
+
+    if (in_frames > (RESAMPLER_HISTORY_FRAMES - RESAMPLER_PRIME_FRAMES)) {
+        /* Chunk is too big for the history. */
+        inst->stable_frames = 0;
+        return false;
+    }
+
+    if (inst->passthrough) {
+        /* Use a wider window to get out of passthrough mode so that
+         * it doesn't bounce back and forth.
+         */
+        if (ppm <= RESAMPLER_PASSTHROUGH_EXIT_PPM) {
+            return true;
+        }
+        inst->stable_frames = 0;
+        return false;
+    }
+
+    if (ppm <= RESAMPLER_PASSTHROUGH_PPM) {
+        if (inst->stable_frames < inst->hold_frames) {
+            inst->stable_frames += in_frames;
+        }
+    } else {
+        inst->stable_frames = 0;
+    }
+
+    return (inst->stable_frames >= inst->hold_frames);
+}
+
+/* Initialize the resampler. */
+int resampler_init(struct resampler *inst, uint32_t channels, uint32_t rate)
+{
+    int error;
+
+    memset(inst, 0, sizeof(struct resampler));
+
+    if (channels > RESAMPLER_MAX_CHANNELS) {
+        printf("Too many resampler channels (%u)\n", channels);
+        return -1;
+    }
+
+    inst->channels = channels;
+    inst->hold_frames = ((uint64_t)RESAMPLER_PASSTHROUGH_HOLD_MS * rate) / 1000u;
+
+    inst->src = src_new(SRC_SINC_BEST_QUALITY, channels, &error);
+    if (!inst->src) {
+        printf("Could not create sample rate converter instance\n");
+        return -1;
+    }
+
+    inst->src_data.end_of_input = 0;
+
+    /* Measure the latency by priming with silence (the history is
+     * all zeros at this point) and seeing how much comes out.
+     */
+    inst->latency = RESAMPLER_PRIME_FRAMES - prime(inst);
+    src_reset(inst->src);
+
+    return 0;
+}
+
+/* Reset the resampler. */
+void resampler_reset(struct resampler *inst)
+{
+    if (inst->src) {
+        src_reset(inst->src);
+    }
+
+    memset(inst->history, 0, sizeof(inst->history));
+    inst->in_pos = 0;
+    inst->passthrough = false;
+    inst->stable_frames = 0;
+    inst->passthrough_entries = 0;
+}
+
+/* Free the resampler. */
+void resampler_free(struct resampler *inst)
+{
+    if (inst->src) {
+        src_delete(inst->src);
+        inst->src = NULL;
+    }
+}
+
+/* Resample a chunk of frames. */
+size_t resampler_process(struct resampler *inst,
+                         const float *in,
+                         size_t in_frames,
+                         float *out,
+                         size_t out_frames,
+                         double ratio)
+{
+    size_t i;
+    size_t j;
+    size_t produced;
+    float w;
+    float *direct;
+    bool want_passthrough;
+    /* First frame of the (delayed) direct path for this chunk. */
+    const uint32_t start = inst->in_pos - inst->latency;
+
+#ifdef RESAMPLER_PASSTHROUGH
+    want_passthrough = passthrough_wanted(inst, ratio, in_frames);
+#else
+    want_passthrough = false;
+#endif
+
+    if (in_frames > out_frames) {
+        /* Never happens with a ratio anywhere near 1.0. */
+        want_passthrough = false;
+    }
+
+    /* Save the input. */
+    for (i = 0; i < in_frames; i++) {
+        memcpy(history_frame(inst, inst->in_pos + i),
+               &in[i * inst->channels],
+               inst->channels * sizeof(float));
+    }
+
+    if (inst->passthrough && want_passthrough) {
+        /* Bit-exact copy. */
+        for (i = 0; i < in_frames; i++) {
+            memcpy(&out[i * inst->channels],
+                   history_frame(inst, start + i),
+                   inst->channels * sizeof(float));
+        }
+
+        inst->in_pos += in_frames;
+
+        return in_frames;
+    }
+
+    if (inst->passthrough) {
+        /* Leaving passthrough. Get the converter back to where it would
+         * have been so its output lines up with the direct path.
+         */
+        prime(inst);
+    }
+
+    produced = convert(inst, in, in_frames, out, out_frames, ratio);
+
+    if (inst->passthrough && !want_passthrough) {
+        /* Fade from the direct path into the converter output. */
+        printf("Drift detected; leaving resampler passthrough\n");
+
+        for (i = 0; (i < produced) && (i < in_frames) && (i < RESAMPLER_XFADE_FRAMES); i++) {
+            w = (float)(i + 1u) / (RESAMPLER_XFADE_FRAMES + 1u);
+            direct = history_frame(inst, start + i);
+            for (j = 0; j < inst->channels; j++) {
+                out[(i * inst->channels) + j] = (direct[j] * (1.0f - w)) +
+                                                (out[(i * inst->channels) + j] * w);
+            }
+        }
+    } else if (!inst->passthrough && want_passthrough) {
+        /* Fade from the converter output into the direct path. */
+        printf("Input and output appear to share a clock; using resampler passthrough\n");
+
+        for (i = 0; i < in_frames; i++) {
+            direct = history_frame(inst, start + i);
+            if ((i < produced) && (i < RESAMPLER_XFADE_FRAMES)) {
+                w = (float)(i + 1u) / (RESAMPLER_XFADE_FRAMES + 1u);
+                for (j = 0; j < inst->channels; j++) {
+                    out[(i * inst->channels) + j] = (out[(i * inst->channels) + j] * (1.0f - w)) +
+                                                    (direct[j] * w);
+                }
+            } else {
+                memcpy(&out[i * inst->channels], direct, inst->channels * sizeof(float));
+            }
+        }
+
+        produced = in_frames;
+        inst->passthrough_entries++;
+    }
+
+    inst->passthrough = want_passthrough;
+    inst->in_pos += in_frames;
+
+    return produced;
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RESAMPLER_H_
+#define _RESAMPLER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <samplerate.h>
+
+#include "config.h"
+
+struct resampler {
+    uint32_t channels;
+    SRC_STATE *src;
+    SRC_DATA src_data;
+
+    /* Most recent input frames (interleaved). This is used as the delay
+     * line in passthrough mode and to prime the converter when leaving it.
+     */
+    float history[RESAMPLER_HISTORY_FRAMES * RESAMPLER_MAX_CHANNELS];
+    uint32_t in_pos; /* Total input frames, wraps. */
+
+    /* Converter latency in input frames (measured at init). */
+    uint32_t latency;
+
+    bool passthrough;
+    uint32_t stable_frames;
+    uint32_t hold_frames;
+    uint32_t passthrough_entries;
+};
+
+/* Initialize a resampler for interleaved frames with the given number
+ * of channels. Rate is the nominal input rate, which is only used
+ * to convert the passthrough hold time. Returns 0 on success.
+ */
+int resampler_init(struct resampler *inst, uint32_t channels, uint32_t rate);
+
+/* Reset the resampler to its initial state, as if it was just
+ * initialized, but without having to re-measure the latency.
+ */
+void resampler_reset(struct resampler *inst);
+
+void resampler_free(struct resampler *inst);
+
+/* Resample in_frames of interleaved input into out (which has room for
+ * out_frames frames) with the given ratio. Returns the number of
+ * frames written to out.
+ */
+size_t resampler_process(struct resampler *inst,
+                         const float *in,
+                         size_t in_frames,
+                         float *out,
+                         size_t out_frames,
+                         double ratio);
+
+
+#endif /* _RESAMPLER_H_ */
@@ -0,0 +1,580 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sink core shared by the PCM and compressed sinks. The front-ends turn
+ * their input into interleaved float frames, and everything from there
+ * on happens here: the samples go through the drift compensation (the
+ * resampler, frame slipper, or nothing, depending on DRIFT_COMP_MODE)
+ * and the time stretcher, and into a ring buffer that an output thread
+ * drains into the Pulseaudio stream. The sampling rate ratio is
+ * dynamically adjusted to attempt to maintain a constant amount of data
+ * in the ring buffer, since the input and output may be running off of
+ * two different clocks.
+ *
+ * The buffers are declared by each front-end with SINK_CORE_STORAGE(),
+ * so they're sized for exactly what that front-end feeds in.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sink_core.h"
+#include "config.h"
+
+/* Returns the number of space available, in samples. */
+static uint32_t buffer_space_avail(struct sink_core *inst)
+{
+    return (inst->config.buffer_size - (inst->write_idx - inst->read_idx));
+}
+
+/* Returns the current buffer utilization, in samples. */
+static uint32_t buffer_used(struct sink_core *inst)
+{
+    return (inst->write_idx - inst->read_idx);
+}
+
+/* Copy nr_samples into the ring buffer. The ring wraps at most once per
+ * copy, so this is done in (at most) two straight copies instead of
+ * masking the index of every sample.
+ */
+static void buffer_write(struct sink_core *inst, const float *data, uint32_t nr_samples)
+{
+    const uint32_t pos = inst->write_idx & inst->buffer_mask;
+    uint32_t first = inst->config.buffer_size - pos;
+
+    if (first > nr_samples) {
+        first = nr_samples;
+    }
+
+    memcpy(&inst->config.buffer[pos], data, first * sizeof(float));
+    memcpy(inst->config.buffer, &data[first], (nr_samples - first) * sizeof(float));
+    inst->write_idx += nr_samples;
+}
+
+/* Copy nr_samples out of the ring buffer. */
+static void buffer_read(struct sink_core *inst, float *data, uint32_t nr_samples)
+{
+    const uint32_t pos = inst->read_idx & inst->buffer_mask;
+    uint32_t first = inst->config.buffer_size - pos;
+
+    if (first > nr_samples) {
+        first = nr_samples;
+    }
+
+    memcpy(data, &inst->config.buffer[pos], first * sizeof(float));
+    memcpy(&data[first], inst->config.buffer, (nr_samples - first) * sizeof(float));
+    inst->read_idx += nr_samples;
+}
+
+/* Returns the monotonic time in nanoseconds. */
+uint64_t sink_core_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000u) + ts.tv_nsec;
+}
+
+/* Returns the CPU time used by the calling thread in nanoseconds. */
+uint64_t sink_core_thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000u) + ts.tv_nsec;
+}
+
+/* Output thread. Writes data from the intermediate buffer into
+ * the Pulseaudio stream in units of inst->chunk_size samples. In
+ * DRIFT_COMP_SRC_PULL mode, the chunk is pulled through the resampler
+ * instead of being copied straight out of the buffer.
+ * The time between returns from the (blocking) write call is also
+ * measured so that the rate loop can account for consumer jitter.
+ */
+static void *output_thread(void *arg)
+{
+    uint64_t now;
+    uint64_t last_ready_ns;
+    int64_t late_ns;
+    bool have_late;
+    uint32_t frames;
+    struct sink_core *inst = (struct sink_core *)arg;
+    float *tmp = inst->config.chunk_buf;
+    /* Time it takes the output to consume one chunk. */
+    const int64_t chunk_ns = ((int64_t)inst->chunk_size * 1000000000) / ((int64_t)inst->out_rate * inst->channels);
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+    bool run;
+    double ratio;
+#endif
+
+    last_ready_ns = 0;
+    late_ns = 0;
+    have_late = false;
+    frames = 0;
+
+    while (1) {
+        pthread_mutex_lock(&inst->lock);
+
+        if (have_late) {
+            rate_loop_add_wakeup_jitter(&inst->loop, (late_ns * (int64_t)inst->buffer_rate * inst->channels) / 1000000000);
+            have_late = false;
+        }
+
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+        /* The output just consumed the previous chunk. */
+        if (last_ready_ns) {
+            rate_loop_dll_update(&inst->out_dll, frames, last_ready_ns);
+        }
+
+        ratio = inst->pull_ratio;
+
+        pthread_mutex_unlock(&inst->lock);
+
+        /* Pull exactly one chunk through the resampler. This blocks
+         * in pull_callback() until there's enough input.
+         */
+        frames = src_callback_read(inst->pull_converter, ratio, inst->chunk_size / inst->channels, tmp);
+
+        pthread_mutex_lock(&inst->lock);
+        run = inst->thread_run;
+        pthread_mutex_unlock(&inst->lock);
+
+        if (!run) {
+            /* Terminate. */
+            pthread_exit(NULL);
+        }
+#else
+        /* Wait for data. */
+        while ((buffer_used(inst) < inst->chunk_size) && inst->thread_run) {
+            pthread_cond_wait(&inst->cond, &inst->lock);
+        }
+
+        if (!inst->thread_run) {
+            /* Terminate. */
+            pthread_mutex_unlock(&inst->lock);
+            pthread_exit(NULL);
+        }
+
+        /* Copy out one chunk. */
+        buffer_read(inst, tmp, inst->chunk_size);
+
+        pthread_mutex_unlock(&inst->lock);
+
+        frames = inst->chunk_size / inst->channels;
+#endif
+
+        if (pa_output_write(&inst->output, tmp, frames * inst->channels * sizeof(float)) < 0) {
+            printf("Could not write chunk to output stream\n");
+        }
+
+        now = sink_core_now_ns();
+        if (last_ready_ns) {
+            late_ns = (int64_t)(now - last_ready_ns) - chunk_ns;
+            have_late = true;
+        }
+        last_ready_ns = now;
+    }
+
+    /* Not reached. */
+    pthread_exit(NULL);
+}
+
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+/* Resampler input callback. This is called by src_callback_read()
+ * from the output thread whenever the resampler needs more input,
+ * and blocks until one output chunk worth of (input rate) samples
+ * is available in the buffer. Returning 0 ends the stream, so that
+ * only happens when the sink is being closed.
+ */
+static long pull_callback(void *cb_data, float **data)
+{
+    struct sink_core *inst = (struct sink_core *)cb_data;
+
+    pthread_mutex_lock(&inst->lock);
+
+    while ((buffer_used(inst) < inst->chunk_size) && inst->thread_run) {
+        pthread_cond_wait(&inst->cond, &inst->lock);
+    }
+
+    if (!inst->thread_run) {
+        pthread_mutex_unlock(&inst->lock);
+        return 0;
+    }
+
+    buffer_read(inst, inst->config.pull_buf, inst->chunk_size);
+
+    pthread_mutex_unlock(&inst->lock);
+
+    *data = inst->config.pull_buf;
+
+    return inst->chunk_size / inst->channels;
+}
+#endif
+
+/* Get the Pulseaudio buffer size required to achieve the
+ * requested latency.
+ */
+static uint32_t calculate_pa_buf_size(struct sink_core *inst,
+                                      uint32_t latency_us)
+{
+    const double latency_seconds = ((double)latency_us / 1000000.0);
+    const double latency_samples = latency_seconds * inst->out_rate;
+    /* 4 byte samples. */
+    const uint32_t bytes = latency_samples * 4u * inst->channels;
+
+    if (!latency_us || (bytes < inst->config.pa_buffer_size)) {
+        printf("Using default sink buffer size of %d bytes\n", inst->config.pa_buffer_size);
+        return inst->config.pa_buffer_size;
+    }
+
+    printf("PA buffer size = %d bytes\n", bytes);
+
+    return bytes;
+}
+
+/* Set up the rate converter for the current channel count. */
+static void init_converter(struct sink_core *inst)
+{
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC
+    resampler_free(&inst->resampler);
+    if (resampler_init(&inst->resampler, inst->channels, inst->rate) < 0) {
+        printf("Could not create %s sink resampler\n", inst->config.name);
+        /* TODO - Handle failure. Program will crash if output is called... */
+    }
+#elif DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+    int error;
+
+    /* In pull mode, the buffer holds interleaved samples at the input
+     * rate, so one multichannel resampler reads them all at once.
+     */
+    if (inst->pull_converter) {
+        src_delete(inst->pull_converter);
+    }
+    inst->pull_converter = src_callback_new(pull_callback, SRC_SINC_BEST_QUALITY,
+                                            inst->channels, &error, inst);
+    if (!inst->pull_converter) {
+        printf("Could not create sample rate converter instance\n");
+        /* TODO - Handle failure. Program will crash if output is called... */
+    }
+#endif
+
+    inst->converter_channels = inst->channels;
+}
+
+/* Set up the core. */
+void sink_core_init(struct sink_core *inst, const struct sink_core_config *config)
+{
+    memset(inst, 0, sizeof(struct sink_core));
+
+    inst->config = *config;
+    inst->buffer_mask = config->buffer_size - 1u;
+
+    pthread_mutex_init(&inst->lock, NULL);
+    pthread_cond_init(&inst->cond, NULL);
+}
+
+/* Set up the rate converter ahead of time. */
+void sink_core_prepare(struct sink_core *inst, uint32_t rate, uint32_t channels)
+{
+    inst->rate = rate;
+    inst->channels = channels;
+    init_converter(inst);
+}
+
+/* Rounds a number of samples down to whole frames. */
+static uint32_t whole_frames(struct sink_core *inst, uint32_t samples)
+{
+    return (samples / inst->channels) * inst->channels;
+}
+
+/* Set up the rate loop. */
+static void init_loop(struct sink_core *inst, uint32_t hist_size)
+{
+    rate_loop_init(&inst->loop,
+                   whole_frames(inst, inst->config.target),
+                   inst->config.loop_gain,
+                   hist_size);
+#ifdef RATE_LOOP_ADAPTIVE_TARGET
+    rate_loop_enable_adaptive_target(&inst->loop,
+                                     inst->chunk_size * 2,
+                                     whole_frames(inst, inst->config.buffer_size / 4),
+                                     inst->config.jitter_bucket_width);
+#endif
+}
+
+/* Open the core. */
+void sink_core_open(struct sink_core *inst,
+                    uint32_t latency_us,
+                    uint32_t rate,
+                    uint32_t sink_rate,
+                    uint32_t channels,
+                    const pa_channel_map *map)
+{
+    uint32_t bufsize;
+    pa_buffer_attr attr;
+    pa_sample_spec pa_ss;
+
+    inst->rate = rate;
+    inst->channels = channels;
+
+#if (DRIFT_COMP_MODE == DRIFT_COMP_SRC) || (DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL)
+    /* Our resampler is running anyway, so have it convert straight
+     * to the rate of the sink instead of having the server resample
+     * everything a second time.
+     */
+    inst->out_rate = sink_rate ? sink_rate : rate;
+#else
+    inst->out_rate = rate;
+#endif
+    inst->rate_ratio = (double)inst->out_rate / rate;
+
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+    inst->buffer_rate = rate;
+#else
+    inst->buffer_rate = inst->out_rate;
+#endif
+
+    if (inst->out_rate != rate) {
+        printf("%s: Converting from %u Hz to the sink rate of %u Hz\n", inst->config.name, rate, inst->out_rate);
+    }
+
+    /* The chunk has to be whole frames, which isn't a given for
+     * every channel count.
+     */
+    inst->chunk_size = whole_frames(inst, inst->config.chunk_size);
+
+    pa_ss.format = PA_SAMPLE_FLOAT32LE;
+    pa_ss.rate = inst->out_rate;
+    pa_ss.channels = channels;
+
+    inst->open_ns = sink_core_now_ns();
+    inst->process_cpu_ns = 0;
+
+    /* Initialize buffer to be at the target. This provides a better starting point for the loop.
+     * The target is rounded down to whole frames so that the reads stay lined up with the frames.
+     */
+    inst->read_idx = 0;
+    inst->write_idx = whole_frames(inst, inst->config.target);
+    memset(inst->config.buffer, 0, inst->config.buffer_size * sizeof(float));
+    init_loop(inst, inst->config.hist_size);
+
+    rate_loop_dll_init(&inst->in_dll, rate);
+    rate_loop_dll_init(&inst->out_dll, inst->out_rate);
+    inst->pull_ratio = 1.0;
+
+    /* The converters are expensive to create, so they're kept around
+     * for as long as the channel count stays the same.
+     */
+    if (inst->converter_channels != channels) {
+        init_converter(inst);
+    }
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC
+    resampler_reset(&inst->resampler);
+#elif DRIFT_COMP_MODE == DRIFT_COMP_SLIP
+    frame_slip_init(&inst->slip, channels);
+#elif DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+    src_reset(inst->pull_converter);
+#endif
+
+    /* Configure buffer for low latency. */
+    bufsize = calculate_pa_buf_size(inst, latency_us);
+    attr.maxlength = bufsize;
+    attr.tlength = bufsize;
+    attr.prebuf = bufsize;
+    attr.minreq = 8;
+    attr.fragsize = -1;
+
+    /* Open pulseaudio stream. */
+    if (pa_output_open(&inst->output,
+                       &pa_ss,
+                       map,
+                       &attr,
+                       DRIFT_COMP_MODE == DRIFT_COMP_SERVER) < 0) {
+        printf("Could not open Pulseaudio stream\n");
+        /* TODO - Handle failure. Program will crash if output is called... */
+    }
+
+    inst->ratio = 1.0;
+    time_stretch_init(&inst->stretch, channels);
+    inst->stretch_speed = 1.0;
+
+    inst->thread_run = true;
+    pthread_create(&inst->thread, NULL, output_thread, inst);
+    /* TODO - Check return. */
+}
+
+/* Close the core. The rate converter is kept around for the next open. */
+void sink_core_close(struct sink_core *inst)
+{
+    /* Kill the thread. */
+    pthread_mutex_lock(&inst->lock);
+    inst->thread_run = false;
+    pthread_cond_broadcast(&inst->cond);
+    pthread_mutex_unlock(&inst->lock);
+    pthread_join(inst->thread, NULL);
+
+    /* Kill Pulseaudio connection. */
+    pa_output_flush(&inst->output);
+    pa_output_close(&inst->output);
+}
+
+/* Cleanup the rate converter. */
+void sink_core_free(struct sink_core *inst)
+{
+    resampler_free(&inst->resampler);
+    if (inst->pull_converter) {
+        src_delete(inst->pull_converter);
+        inst->pull_converter = NULL;
+    }
+    inst->converter_channels = 0;
+}
+
+/* Retune the rate loop. */
+void sink_core_init_loop(struct sink_core *inst, uint32_t hist_size)
+{
+    pthread_mutex_lock(&inst->lock);
+    init_loop(inst, hist_size);
+    pthread_mutex_unlock(&inst->lock);
+}
+
+/* Get a snapshot of the core statistics. */
+void sink_core_get_stats(struct sink_core *inst, struct sink_core_stats *stats)
+{
+    pthread_mutex_lock(&inst->lock);
+    stats->buffer_used = buffer_used(inst);
+    rate_loop_get_stats(&inst->loop, &stats->loop);
+    stats->measured_ratio = rate_loop_dll_rate(&inst->out_dll) / rate_loop_dll_rate(&inst->in_dll);
+    stats->cpu_percent = (inst->process_cpu_ns * 100.0) / (sink_core_now_ns() - inst->open_ns);
+    pthread_mutex_unlock(&inst->lock);
+
+    /* Only touched by the processing thread. */
+    stats->rate_updates = inst->output.rate_updates;
+    stats->passthrough = inst->resampler.passthrough;
+    stats->passthrough_entries = inst->resampler.passthrough_entries;
+    stats->inserted_frames = inst->slip.inserted;
+    stats->dropped_frames = inst->slip.dropped;
+    stats->stretch_speed = inst->stretch_speed;
+    stats->stretch_engagements = inst->stretch.engagements;
+    stats->stretch_splices = inst->stretch.splices;
+}
+
+/* Run nr_frames of interleaved input through the drift compensation
+ * and time stretcher and into the ring buffer. All input data must
+ * pass through here even if it ends up getting dropped.
+ */
+void sink_core_queue(struct sink_core *inst, const float *in, size_t nr_frames, uint64_t cpu_start)
+{
+    uint32_t can_queue;
+    uint32_t nr_out;
+    double ratio;
+    const float *out;
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+    /* Input frames, for the rate measurement. */
+    const size_t in_frames = nr_frames;
+#endif
+
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC
+    /* Resample. One frame == one sample from every channel. */
+    nr_frames = resampler_process(&inst->resampler,
+                                  in,
+                                  nr_frames,
+                                  inst->config.output_buf,
+                                  inst->config.output_buf_size / inst->channels,
+                                  inst->ratio * inst->rate_ratio);
+    out = inst->config.output_buf;
+#elif DRIFT_COMP_MODE == DRIFT_COMP_SLIP
+    /* Copy, slipping a frame if needed. */
+    nr_frames = frame_slip_process(&inst->slip,
+                                   in,
+                                   nr_frames,
+                                   inst->config.output_buf,
+                                   inst->ratio);
+    out = inst->config.output_buf;
+#else
+    /* Either the server or the output thread takes care of the
+     * rate conversion, so the samples go straight into the buffer.
+     */
+    out = in;
+#endif
+
+    /* Speed up or slow down if the level is way off. */
+    nr_frames = time_stretch_process(&inst->stretch,
+                                     out,
+                                     nr_frames,
+                                     inst->config.stretch_buf,
+                                     inst->config.stretch_buf_size / inst->channels,
+                                     inst->stretch_speed);
+    out = inst->config.stretch_buf;
+    nr_out = nr_frames * inst->channels;
+
+    pthread_mutex_lock(&inst->lock);
+
+    ratio = rate_loop_update(&inst->loop, buffer_used(inst));
+    inst->ratio = ratio;
+#ifdef TIME_STRETCH
+    inst->stretch_speed = time_stretch_control(&inst->stretch, buffer_used(inst), inst->loop.target);
+#endif
+
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+    /* The bulk of the ratio comes from the measured rates, and the
+     * loop just trims out whatever level error is left.
+     */
+    rate_loop_dll_update(&inst->in_dll, in_frames, sink_core_now_ns());
+    inst->pull_ratio = ratio * (rate_loop_dll_rate(&inst->out_dll) / rate_loop_dll_rate(&inst->in_dll));
+#endif
+
+#ifdef DEBUG
+    printf("Buffer: %04d    Ratio: %f    Avg: %d    Gear: %s\n", buffer_used(inst), ratio,
+           inst->loop.average, rate_loop_gear_str(inst->loop.gear));
+#endif
+
+    /* First, figure out how many samples we can queue.
+     * NOTE: This relies on the fact that the data is drained
+     *       in whole frames. If for example only one sample
+     *       is drained, then our Pulseaudio sink might get out
+     *       of sync w.r.t the channels. The buffer size isn't
+     *       necessarily a multiple of the channel count, so
+     *       round the space down to whole frames too.
+     */
+    can_queue = buffer_space_avail(inst);
+    can_queue -= can_queue % inst->channels;
+
+    if (can_queue < nr_out) {
+        if (inst->config.drop_whole_blocks) {
+            printf("Can't fit entire frame, so dropping entire frame (%u < %u)\n", can_queue, nr_out);
+            nr_out = 0;
+        } else {
+            nr_out = can_queue;
+        }
+    }
+
+    buffer_write(inst, out, nr_out);
+
+    inst->process_cpu_ns += sink_core_thread_cpu_ns() - cpu_start;
+
+    pthread_mutex_unlock(&inst->lock);
+    pthread_cond_broadcast(&inst->cond);
+
+#if DRIFT_COMP_MODE == DRIFT_COMP_SERVER
+    pa_output_set_ratio(&inst->output, ratio);
+#endif
+}
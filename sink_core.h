@@ -0,0 +1,224 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SINK_CORE_H_
+#define _SINK_CORE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <samplerate.h>
+
+#include "config.h"
+#include "rate_loop.h"
+#include "pa_output.h"
+#include "resampler.h"
+#include "frame_slip.h"
+#include "time_stretch.h"
+
+/* Declares the buffers that a sink core runs on, sized at compile time
+ * for one front-end. The ring buffer holds buffer_size samples (a power
+ * of 2), chunks of up to chunk_size samples are written to the output,
+ * and the drift compensation and time stretcher write into scratch
+ * buffers of out_size and stretch_size samples.
+ */
+#define SINK_CORE_STORAGE(buffer_size, chunk_size, out_size, stretch_size)  \
+    struct {                                                                \
+        float buffer[buffer_size];                                          \
+        float chunk[chunk_size];                                            \
+        float pull[chunk_size];                                             \
+        float output[out_size];                                             \
+        float stretch[stretch_size];                                        \
+    }
+
+/* Fills in the buffer pointers and sizes of a sink_core_config from
+ * something declared with SINK_CORE_STORAGE().
+ */
+#define SINK_CORE_CONFIG_STORAGE(config, storage)                           \
+    do {                                                                    \
+        (config)->buffer = (storage)->buffer;                               \
+        (config)->buffer_size = sizeof((storage)->buffer) / sizeof(float);  \
+        (config)->chunk_buf = (storage)->chunk;                             \
+        (config)->pull_buf = (storage)->pull;                               \
+        (config)->chunk_size = sizeof((storage)->chunk) / sizeof(float);    \
+        (config)->output_buf = (storage)->output;                           \
+        (config)->output_buf_size = sizeof((storage)->output) / sizeof(float); \
+        (config)->stretch_buf = (storage)->stretch;                         \
+        (config)->stretch_buf_size = sizeof((storage)->stretch) / sizeof(float); \
+    } while (0)
+
+/* Everything that differs between the PCM and compressed sinks. */
+struct sink_core_config {
+    /* Prefix for log messages. */
+    const char *name;
+
+    float *buffer;
+    uint32_t buffer_size;
+    float *chunk_buf;
+    float *pull_buf;
+    uint32_t chunk_size;
+    float *output_buf;
+    size_t output_buf_size;
+    float *stretch_buf;
+    size_t stretch_buf_size;
+
+    /* Default Pulseaudio buffer size, in bytes. */
+    uint32_t pa_buffer_size;
+
+    /* Rate loop tuning (see config.h). */
+    uint32_t target;
+    double loop_gain;
+    uint32_t hist_size;
+    /* Resolution of the adaptive target's jitter histograms, in
+     * samples per bucket.
+     */
+    uint32_t jitter_bucket_width;
+
+    /* If a block doesn't fit in the ring buffer, drop all of it instead
+     * of queueing whatever part of it does fit.
+     */
+    bool drop_whole_blocks;
+};
+
+struct sink_core_stats {
+    uint32_t buffer_used;
+    struct rate_loop_stats loop;
+    /* CPU time spent in the process call relative to real time. */
+    double cpu_percent;
+    /* Measured output rate / input rate (DRIFT_COMP_SRC_PULL only). */
+    double measured_ratio;
+    /* Number of stream rate updates sent to the server. */
+    uint32_t rate_updates;
+    /* Resampler passthrough state (DRIFT_COMP_SRC only). */
+    bool passthrough;
+    uint32_t passthrough_entries;
+    /* Frames repeated/dropped (DRIFT_COMP_SLIP only). */
+    uint32_t inserted_frames;
+    uint32_t dropped_frames;
+    /* Time stretcher state. */
+    double stretch_speed;
+    uint32_t stretch_engagements;
+    uint32_t stretch_splices;
+};
+
+/* The part of a sink that comes after the front-end has turned its
+ * input into interleaved float: the drift compensation, time stretcher,
+ * ring buffer, rate loop, and the output thread that feeds Pulseaudio.
+ */
+struct sink_core {
+    struct sink_core_config config;
+
+    pthread_mutex_t lock;
+    pthread_t thread;
+    pthread_cond_t cond;
+    bool thread_run;
+
+    /* Used in DRIFT_COMP_SRC mode. */
+    struct resampler resampler;
+    /* Used in DRIFT_COMP_SLIP mode. */
+    struct frame_slip slip;
+    /* Used in DRIFT_COMP_SRC_PULL mode. */
+    SRC_STATE *pull_converter;
+    /* Channel count that the converter was set up for. */
+    uint32_t converter_channels;
+    struct pa_output output;
+
+    uint32_t buffer_mask;
+    uint32_t read_idx;
+    uint32_t write_idx;
+
+    /* Input sampling rate and channel count. */
+    uint32_t rate;
+    uint32_t channels;
+    /* Rate that the output stream runs at. In DRIFT_COMP_SRC and
+     * DRIFT_COMP_SRC_PULL modes, this is the sink's own rate, and
+     * rate_ratio (out_rate / rate) is folded into the resampler ratio.
+     * The ring buffer holds samples at buffer_rate.
+     */
+    uint32_t out_rate;
+    double rate_ratio;
+    uint32_t buffer_rate;
+    /* Samples per output chunk, in whole frames. */
+    uint32_t chunk_size;
+
+    struct rate_loop loop;
+    /* Ratio applied to the next block. */
+    double ratio;
+
+    /* Used to quickly work off large level errors. */
+    struct time_stretch stretch;
+    double stretch_speed;
+
+    uint64_t open_ns;
+    uint64_t process_cpu_ns;
+
+    /* Only used in DRIFT_COMP_SRC_PULL mode. */
+    struct rate_loop_dll in_dll;
+    struct rate_loop_dll out_dll;
+    double pull_ratio;
+};
+
+/* Returns the monotonic time in nanoseconds. */
+uint64_t sink_core_now_ns(void);
+
+/* Returns the CPU time used by the calling thread in nanoseconds. */
+uint64_t sink_core_thread_cpu_ns(void);
+
+/* Set up the core with the given configuration. This only needs to be
+ * called once, and the core can then be opened and closed any number
+ * of times.
+ */
+void sink_core_init(struct sink_core *inst, const struct sink_core_config *config);
+
+/* Set up the rate converter for the given rate and channel count ahead
+ * of time, so that it's ready to go by the first open. Otherwise, it's
+ * set up whenever the core is opened with a different channel count.
+ */
+void sink_core_prepare(struct sink_core *inst, uint32_t rate, uint32_t channels);
+
+/* Open the output for interleaved float input with the given rate and
+ * channel count, using the given channel map. sink_rate is the rate
+ * that the sink runs at (or 0 if it's unknown), which the input is
+ * converted to in DRIFT_COMP_SRC and DRIFT_COMP_SRC_PULL modes.
+ */
+void sink_core_open(struct sink_core *inst,
+                    uint32_t latency_us,
+                    uint32_t rate,
+                    uint32_t sink_rate,
+                    uint32_t channels,
+                    const pa_channel_map *map);
+
+void sink_core_close(struct sink_core *inst);
+
+/* Free everything that was set up by opening the core. */
+void sink_core_free(struct sink_core *inst);
+
+/* Set up the rate loop with the given averaging window. Takes the lock,
+ * so it can be called while the core is open.
+ */
+void sink_core_init_loop(struct sink_core *inst, uint32_t hist_size);
+
+void sink_core_get_stats(struct sink_core *inst, struct sink_core_stats *stats);
+
+/* Queue nr_frames of interleaved float input. cpu_start is when the
+ * caller started processing (for the stats).
+ */
+void sink_core_queue(struct sink_core *inst, const float *in, size_t nr_frames, uint64_t cpu_start);
+
+
+#endif /* _SINK_CORE_H_ */
@@ -0,0 +1,378 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * WSOLA style time stretcher used to quickly recover the buffer level
+ * after a stall. The rate loop gain is kept tiny so that the pitch
+ * change is inaudible, so on its own it can take seconds to work off
+ * a large error. While the error is large, this changes the playback
+ * speed by a few percent without changing the pitch by splicing out
+ * (or repeating) a single period of the waveform every so often.
+ * The period is picked by searching for the lag where the waveform
+ * is most similar to itself, and each splice is an overlap-add
+ * crossfade over that period, so it's pretty much inaudible on
+ * anything with some periodicity to it.
+ * When idle, this is just a copy and adds no latency.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "time_stretch.h"
+#include "config.h"
+
+/* Returns the mono sum of a frame. */
+static float mono(struct time_stretch *inst, const float *frame)
+{
+    uint32_t i;
+    float sum = 0;
+
+    for (i = 0; i < inst->channels; i++) {
+        sum += frame[i];
+    }
+
+    return sum;
+}
+
+/* Average magnitude difference between x and x delayed by the given
+ * lag (in frames), computed over lag frames and then normalized.
+ */
+static float amdf(struct time_stretch *inst, const float *x, uint32_t lag)
+{
+    uint32_t i;
+    float d;
+    float sum = 0;
+    const uint32_t ch = inst->channels;
+
+    for (i = 0; i < lag; i++) {
+        d = mono(inst, &x[i * ch]) - mono(inst, &x[(i + lag) * ch]);
+        sum += (d < 0) ? -d : d;
+    }
+
+    return sum / lag;
+}
+
+/* Find the period (in frames) at which the waveform at x repeats
+ * itself best. x must hold at least 2 * TIME_STRETCH_MAX_PERIOD frames.
+ * The search is done on a decimated copy first and then refined
+ * around the best match at the full rate.
+ */
+static uint32_t find_period(struct time_stretch *inst, const float *x)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t lag;
+    uint32_t best;
+    uint32_t lo;
+    uint32_t hi;
+    float d;
+    float diff;
+    float best_diff;
+    float dec[(2u * TIME_STRETCH_MAX_PERIOD) / TIME_STRETCH_DECIMATION];
+    const uint32_t ch = inst->channels;
+
+    /* Decimate (with a crude box filter). */
+    for (i = 0; i < ((2u * TIME_STRETCH_MAX_PERIOD) / TIME_STRETCH_DECIMATION); i++) {
+        dec[i] = 0;
+        for (j = 0; j < TIME_STRETCH_DECIMATION; j++) {
+            dec[i] += mono(inst, &x[((i * TIME_STRETCH_DECIMATION) + j) * ch]);
+        }
+    }
+
+    /* Coarse search. */
+    best = TIME_STRETCH_MIN_PERIOD / TIME_STRETCH_DECIMATION;
+    best_diff = -1;
+    for (lag = TIME_STRETCH_MIN_PERIOD / TIME_STRETCH_DECIMATION;
+         lag <= (TIME_STRETCH_MAX_PERIOD / TIME_STRETCH_DECIMATION);
+         lag++) {
+        diff = 0;
+        for (i = 0; i < lag; i++) {
+            d = dec[i] - dec[i + lag];
+            diff += (d < 0) ? -d : d;
+        }
+        diff /= lag;
+
+        if ((best_diff < 0) || (diff < best_diff)) {
+            best_diff = diff;
+            best = lag;
+        }
+    }
+
+    /* Fine search around the coarse result. */
+    lo = (best * TIME_STRETCH_DECIMATION) - TIME_STRETCH_DECIMATION;
+    hi = (best * TIME_STRETCH_DECIMATION) + TIME_STRETCH_DECIMATION;
+    if (lo < TIME_STRETCH_MIN_PERIOD) {
+        lo = TIME_STRETCH_MIN_PERIOD;
+    }
+    if (hi > TIME_STRETCH_MAX_PERIOD) {
+        hi = TIME_STRETCH_MAX_PERIOD;
+    }
+
+    best = lo;
+    best_diff = -1;
+    for (lag = lo; lag <= hi; lag++) {
+        diff = amdf(inst, x, lag);
+        if ((best_diff < 0) || (diff < best_diff)) {
+            best_diff = diff;
+            best = lag;
+        }
+    }
+
+    return best;
+}
+
+/* Crossfade from a (fading out) to b (fading in) over len frames. */
+static void overlap_add(struct time_stretch *inst,
+                        float *out,
+                        const float *a,
+                        const float *b,
+                        uint32_t len)
+{
+    uint32_t i;
+    uint32_t j;
+    float w;
+    const uint32_t ch = inst->channels;
+
+    for (i = 0; i < len; i++) {
+        w = (float)i / len;
+        for (j = 0; j < ch; j++) {
+            out[(i * ch) + j] = (a[(i * ch) + j] * (1.0f - w)) + (b[(i * ch) + j] * w);
+        }
+    }
+}
+
+/* Initialize. */
+void time_stretch_init(struct time_stretch *inst, uint32_t channels)
+{
+    memset(inst, 0, sizeof(struct time_stretch));
+
+    if (channels > TIME_STRETCH_MAX_CHANNELS) {
+        printf("Too many time stretch channels (%u)\n", channels);
+        channels = TIME_STRETCH_MAX_CHANNELS;
+    }
+
+    inst->channels = channels;
+    inst->last_speed = 1.0;
+    inst->speed = 1.0;
+    inst->level = -1;
+}
+
+/* Decide on the speed. */
+double time_stretch_control(struct time_stretch *inst, uint32_t level, int32_t target)
+{
+    double speed;
+
+    /* Whatever is held back here is going to end up in the buffer
+     * too, so count it.
+     */
+    level += inst->buf_frames * inst->channels;
+
+    /* The level is sampled right before each chunk is added, so it
+     * jumps around a bit. Smooth it out so that a single late chunk
+     * doesn't engage the stretcher.
+     */
+    if (inst->level < 0) {
+        /* First call. */
+        inst->level = level;
+    }
+    inst->level += (level - inst->level) / TIME_STRETCH_SMOOTHING;
+
+    speed = inst->speed;
+
+    if (speed == 1.0) {
+        if ((inst->level * 100) > ((double)target * TIME_STRETCH_HIGH_PERCENT)) {
+            /* Way too much buffered. Speed up. */
+            speed = 1.0 + (TIME_STRETCH_SPEED_PERCENT / 100.0);
+        } else if ((inst->level * 100) < ((double)target * TIME_STRETCH_LOW_PERCENT)) {
+            /* About to run dry. Slow down. */
+            speed = 1.0 - (TIME_STRETCH_SPEED_PERCENT / 100.0);
+        }
+
+        if (speed != 1.0) {
+            inst->engagements++;
+        }
+    } else if (((speed > 1.0) &&
+                ((inst->level * 100) < ((double)target * (100 + TIME_STRETCH_RELEASE_PERCENT)))) ||
+               ((speed < 1.0) &&
+                ((inst->level * 100) > ((double)target * (100 - TIME_STRETCH_RELEASE_PERCENT))))) {
+        /* Close enough, let the rate loop take it from here. */
+        speed = 1.0;
+    }
+
+    inst->speed = speed;
+
+    return speed;
+}
+
+/* Time stretch a chunk. */
+size_t time_stretch_process(struct time_stretch *inst,
+                            const float *in,
+                            size_t in_frames,
+                            float *out,
+                            size_t out_frames,
+                            double speed)
+{
+    uint32_t n;
+    uint32_t p;
+    uint32_t rd;
+    uint32_t end;
+    uint32_t keep;
+    size_t room;
+    size_t produced;
+    const uint32_t ch = inst->channels;
+
+    if ((speed == 1.0) && !inst->buf_frames) {
+        /* Idle. */
+        inst->hist_frames = 0;
+        inst->last_speed = 1.0;
+        if (in_frames > out_frames) {
+            in_frames = out_frames;
+        }
+        memcpy(out, in, in_frames * ch * sizeof(float));
+        return in_frames;
+    }
+
+    if (speed != inst->last_speed) {
+        /* Start over with a splice. The history is only good for as
+         * long as the output stays contiguous with it.
+         */
+        inst->copy_left = 0;
+        inst->last_speed = speed;
+        memmove(inst->buf, &inst->buf[inst->hist_frames * ch], inst->buf_frames * ch * sizeof(float));
+        inst->hist_frames = 0;
+    }
+
+    room = TIME_STRETCH_BUF_FRAMES - inst->hist_frames - inst->buf_frames;
+    if (in_frames > room) {
+        printf("Time stretch buffer overflow - dropping %zu frames\n", in_frames - room);
+        in_frames = room;
+    }
+
+    memcpy(&inst->buf[(inst->hist_frames + inst->buf_frames) * ch], in, in_frames * ch * sizeof(float));
+    inst->buf_frames += in_frames;
+
+    if ((speed == 1.0) && (out_frames > (2u * in_frames))) {
+        /* Let whatever was held back go a chunk's worth at a time on
+         * top of the input, so that the level doesn't jump.
+         */
+        out_frames = 2u * in_frames;
+    }
+
+    produced = 0;
+    rd = inst->hist_frames;
+    end = inst->hist_frames + inst->buf_frames;
+
+    while (1) {
+        if ((speed == 1.0) || inst->copy_left) {
+            /* Straight copy. When idle, this flushes out whatever was
+             * buffered for the search.
+             */
+            n = end - rd;
+            if ((speed != 1.0) && (n > inst->copy_left)) {
+                n = inst->copy_left;
+            }
+            if (n > (out_frames - produced)) {
+                n = out_frames - produced;
+            }
+            if (!n) {
+                break;
+            }
+
+            memcpy(&out[produced * ch], &inst->buf[rd * ch], n * ch * sizeof(float));
+            produced += n;
+            rd += n;
+            if (speed != 1.0) {
+                inst->copy_left -= n;
+            }
+            continue;
+        }
+
+        if (speed > 1.0) {
+            /* Need two full periods worth of lookahead to splice. */
+            if ((end - rd) < (2u * TIME_STRETCH_MAX_PERIOD)) {
+                break;
+            }
+
+            p = find_period(inst, &inst->buf[rd * ch]);
+
+            /* Drop one period: crossfade the first period into the
+             * second and skip past both.
+             */
+            if ((out_frames - produced) < p) {
+                break;
+            }
+
+            overlap_add(inst, &out[produced * ch], &inst->buf[rd * ch], &inst->buf[(rd + p) * ch], p);
+            produced += p;
+            rd += 2u * p;
+
+            /* Copy enough afterwards to hit the requested speed. */
+            inst->copy_left = (uint32_t)((p * (2.0 - speed)) / (speed - 1.0));
+        } else {
+            /* The buffer is about to run dry, so the period is searched
+             * for in what was already output instead of holding the input
+             * back for it. Until there's enough of that, pass the input
+             * through.
+             */
+            if (rd < (2u * TIME_STRETCH_MAX_PERIOD)) {
+                n = end - rd;
+                if (n > (out_frames - produced)) {
+                    n = out_frames - produced;
+                }
+                if (!n) {
+                    break;
+                }
+
+                memcpy(&out[produced * ch], &inst->buf[rd * ch], n * ch * sizeof(float));
+                produced += n;
+                rd += n;
+                continue;
+            }
+
+            p = find_period(inst, &inst->buf[(rd - (2u * TIME_STRETCH_MAX_PERIOD)) * ch]);
+
+            /* Repeat one period: crossfade from the next period into the
+             * last one that went out, and then continue from the next
+             * period again. This only needs to hold back one period.
+             */
+            if (((end - rd) < p) || ((out_frames - produced) < p)) {
+                break;
+            }
+
+            overlap_add(inst, &out[produced * ch], &inst->buf[rd * ch], &inst->buf[(rd - p) * ch], p);
+            produced += p;
+
+            inst->copy_left = (uint32_t)((p * speed) / (1.0 - speed));
+        }
+
+        inst->splices++;
+    }
+
+    /* Keep whatever is left for next time, along with the history
+     * when slowing down.
+     */
+    keep = 0;
+    if (speed < 1.0) {
+        keep = (rd > (2u * TIME_STRETCH_MAX_PERIOD)) ? (2u * TIME_STRETCH_MAX_PERIOD) : rd;
+    }
+    inst->hist_frames = keep;
+    inst->buf_frames = end - rd;
+    memmove(inst->buf, &inst->buf[(rd - keep) * ch], (keep + inst->buf_frames) * ch * sizeof(float));
+
+    return produced;
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TIME_STRETCH_H_
+#define _TIME_STRETCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+struct time_stretch {
+    uint32_t channels;
+
+    /* Input (interleaved). The first hist_frames have already been
+     * output and are only kept around to splice from when slowing
+     * down. The buf_frames after that haven't been output yet.
+     */
+    float buf[TIME_STRETCH_BUF_FRAMES * TIME_STRETCH_MAX_CHANNELS];
+    uint32_t hist_frames;
+    uint32_t buf_frames;
+
+    /* Frames to copy straight through before the next splice. */
+    uint32_t copy_left;
+    double last_speed;
+
+    /* Smoothed buffer level, used to decide when to engage. */
+    double level;
+    double speed;
+
+    uint32_t engagements;
+    uint32_t splices;
+};
+
+void time_stretch_init(struct time_stretch *inst, uint32_t channels);
+
+/* Decide on the playback speed based on the buffer level and target
+ * (both in samples). Anything held back by the stretcher is added to
+ * the level. Returns 1.0 when the stretcher should be idle,
+ * > 1.0 to drain the buffer, or < 1.0 to fill it.
+ */
+double time_stretch_control(struct time_stretch *inst, uint32_t level, int32_t target);
+
+/* Time stretch in_frames of interleaved input into out (which has room
+ * for out_frames frames) by the given speed. With a speed of 1.0 and
+ * nothing buffered, this is just a copy.
+ * Returns the number of frames written to out.
+ */
+size_t time_stretch_process(struct time_stretch *inst,
+                            const float *in,
+                            size_t in_frames,
+                            float *out,
+                            size_t out_frames,
+                            double speed);
+
+
+#endif /* _TIME_STRETCH_H_ */
@@ -0,0 +1,206 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Wraps the frames of a raw DTS stream (16 bit big endian core frames,
+ * like ffmpeg's "-f dts" output) in IEC 61937 type I/II/III bursts, and
+ * writes them to stdout as a 2 channel S16LE capture, for checking the
+ * DTS path without a source that sends it. Play it into the capture
+ * device's loopback with:
+ *
+ *   pacat --raw --format=s16le --channels=2 --rate=48000 out.raw
+ *
+ * A test stream can be made with libavcodec's encoder:
+ *
+ *   ffmpeg -f lavfi -i sine=frequency=440:sample_rate=48000:duration=10 \
+ *          -ac 6 -c:a dca -strict -2 -b:a 768k -f dts tone.dts
+ *
+ * Usage: dts_vectors file.dts [1|2|3]
+ *
+ * The burst type follows the number of samples in each frame (512,
+ * 1024 or 2048). If a type is given, every frame is sent with that
+ * type and its repetition period instead. That's only useful for
+ * checking the framing, since the audio then doesn't fill the period
+ * (libavcodec only makes 512 sample frames).
+ *
+ * Build: gcc -o dts_vectors tools/dts_vectors.c -Wall -O2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYNC_WORD_0            0xF872
+#define SYNC_WORD_1            0x4E1F
+#define DATA_TYPE_DTS1         0x0B
+
+/* Core frame header fields, as bit offsets from the start of the frame. */
+#define DTS_HEADER_SIZE        10u
+#define DTS_NBLKS_OFFSET       39u
+#define DTS_NBLKS_BITS         7u
+#define DTS_FSIZE_OFFSET       46u
+#define DTS_FSIZE_BITS         14u
+#define DTS_SAMPLES_PER_BLOCK  32u
+
+/* Type I carries 512 samples per burst, and each type after that
+ * doubles it.
+ */
+#define DTS_TYPE_I_SAMPLES     512u
+#define DTS_NR_TYPES           3u
+
+static const uint8_t dts_sync[] = { 0x7F, 0xFE, 0x80, 0x01 };
+
+static uint8_t frame[16384];
+
+static void put_word(uint16_t word)
+{
+    uint8_t bytes[2] = { word & 0xFF, word >> 8u };
+
+    fwrite(bytes, 1, sizeof(bytes), stdout);
+}
+
+/* Returns nr_bits of the frame, starting at the given bit offset. */
+static uint32_t get_bits(uint32_t offset, uint32_t nr_bits)
+{
+    uint32_t i;
+    uint32_t value = 0;
+
+    for (i = offset; i < (offset + nr_bits); i++) {
+        value = (value << 1u) | ((frame[i / 8u] >> (7u - (i % 8u))) & 1u);
+    }
+
+    return value;
+}
+
+/* Reads the next frame into the frame buffer. Returns its length, or 0
+ * at the end of the input (or if it isn't a core frame).
+ */
+static size_t read_frame(FILE *in, uint32_t *nr_samples)
+{
+    size_t len;
+
+    if (fread(frame, 1, DTS_HEADER_SIZE, in) != DTS_HEADER_SIZE) {
+        return 0;
+    }
+
+    if (memcmp(frame, dts_sync, sizeof(dts_sync))) {
+        fprintf(stderr, "Lost sync (only 16 bit big endian core frames are supported)\n");
+        return 0;
+    }
+
+    len = get_bits(DTS_FSIZE_OFFSET, DTS_FSIZE_BITS) + 1u;
+    *nr_samples = (get_bits(DTS_NBLKS_OFFSET, DTS_NBLKS_BITS) + 1u) * DTS_SAMPLES_PER_BLOCK;
+
+    if ((len < DTS_HEADER_SIZE) ||
+        (fread(&frame[DTS_HEADER_SIZE], 1, len - DTS_HEADER_SIZE, in) != (len - DTS_HEADER_SIZE))) {
+        fprintf(stderr, "Truncated frame\n");
+        return 0;
+    }
+
+    return len;
+}
+
+/* Writes one burst (big endian payload words), padded out to the
+ * repetition period with zeros. The length is in bits for DTS.
+ */
+static void put_burst(uint32_t type, size_t len)
+{
+    size_t i;
+    uint32_t words;
+    const uint32_t period_words = (DTS_TYPE_I_SAMPLES << (type - 1u)) * 2u;
+
+    put_word(SYNC_WORD_0);
+    put_word(SYNC_WORD_1);
+    put_word(DATA_TYPE_DTS1 + (type - 1u));
+    put_word((uint16_t)(len * 8u));
+
+    for (i = 0; i < len; i += 2u) {
+        put_word(((uint16_t)frame[i] << 8u) | (((i + 1u) < len) ? frame[i + 1u] : 0));
+    }
+
+    words = 4u + ((len + 1u) / 2u);
+    for (; words < period_words; words++) {
+        put_word(0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in;
+    size_t len;
+    uint32_t i;
+    uint32_t type;
+    uint32_t forced_type = 0;
+    uint32_t nr_samples;
+    uint32_t nr_frames = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s file.dts [1|2|3]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc > 2) {
+        forced_type = atoi(argv[2]);
+        if ((forced_type < 1u) || (forced_type > DTS_NR_TYPES)) {
+            fprintf(stderr, "Type must be 1, 2 or 3\n");
+            return 1;
+        }
+    }
+
+    in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    /* The first burst needs some leading zeros to be found, just like
+     * the later ones get from the padding before them.
+     */
+    for (i = 0; i < 4u; i++) {
+        put_word(0);
+    }
+
+    while ((len = read_frame(in, &nr_samples))) {
+        type = forced_type;
+        if (!type) {
+            for (type = 1u; type <= DTS_NR_TYPES; type++) {
+                if (nr_samples == (DTS_TYPE_I_SAMPLES << (type - 1u))) {
+                    break;
+                }
+            }
+            if (type > DTS_NR_TYPES) {
+                fprintf(stderr, "No burst type for %u sample frames\n", nr_samples);
+                break;
+            }
+        }
+
+        /* The burst header takes 4 words of the period. */
+        if ((len + 8u) > ((DTS_TYPE_I_SAMPLES << (type - 1u)) * 4u)) {
+            fprintf(stderr, "Frame too large for a type %u burst (%zu bytes)\n", type, len);
+            break;
+        }
+
+        put_burst(type, len);
+        nr_frames++;
+    }
+
+    fprintf(stderr, "Wrote %u bursts\n", nr_frames);
+
+    fclose(in);
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Writes HBR (8 channel, 192 kHz, S16LE) test captures to stdout, for
+ * checking the MAT and DTS-HD paths without a source that can send
+ * them. Play one into the capture device's loopback with:
+ *
+ *   pacat --raw --format=s16le --channels=8 --rate=192000 out.raw
+ *
+ * Modes:
+ *   mat [file.thd]  MAT bursts. With a TrueHD elementary stream, its
+ *                   access units are packed 24 to a burst (20 ms at
+ *                   48 kHz). Otherwise, the access units are synthetic,
+ *                   so only the framing and unpacking get exercised.
+ *   mat-oversize    MAT bursts with more TrueHD data than fits in a MAT
+ *                   frame, which the sink should reject. These overrun
+ *                   the MAT period, so some go missing in the state
+ *                   machine too.
+ *   dtshd           DTS-HD bursts with a synthetic 2048 byte frame.
+ *
+ * Build: gcc -o hbr_vectors tools/hbr_vectors.c -Wall -O2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYNC_WORD_0            0xF872
+#define SYNC_WORD_1            0x4E1F
+#define DATA_TYPE_DTSHD        0x11
+#define DATA_TYPE_MAT          0x16
+
+/* Burst repetition periods, in 16 bit words (two per IEC 60958 frame). */
+#define MAT_PERIOD_WORDS       (15360u * 2u)
+/* 2048 frames, which is a period code of 2 in Pc bits 8-10. */
+#define DTSHD_PERIOD_CODE      2u
+#define DTSHD_PERIOD_WORDS     ((512u << DTSHD_PERIOD_CODE) * 2u)
+#define DTSHD_FRAME_SIZE       2048u
+
+/* A MAT frame fills the whole period, less the burst header and the
+ * four leading zero words.
+ */
+#define MAT_PAYLOAD_SIZE       61424u
+#define MAT_MIDDLE_OFFSET      30708u
+#define MAT_AUS_PER_FRAME      24u
+#define SYNTHETIC_AU_SIZE      2000u
+
+static const uint8_t mat_start_code[] = {
+    0x07, 0x9E, 0x00, 0x03, 0x84, 0x01, 0x01, 0x01, 0x80, 0x00,
+    0x56, 0xA5, 0x3B, 0xF4, 0x81, 0x83, 0x49, 0x80, 0x77, 0xE0,
+};
+static const uint8_t mat_middle_code[] = {
+    0xC3, 0xC1, 0x42, 0x49, 0x3B, 0xFA, 0x82, 0x83, 0x49, 0x80, 0x77, 0xE0,
+};
+static const uint8_t mat_end_code[] = {
+    0xC3, 0xC2, 0xC0, 0xC4, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x97, 0x11,
+};
+static const uint8_t dtshd_start_code[] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFE, 0xFE,
+};
+
+static uint8_t payload[0x10000];
+static uint8_t hd_data[0x10000];
+
+static void put_word(uint16_t word)
+{
+    uint8_t bytes[2] = { word & 0xFF, word >> 8u };
+
+    fwrite(bytes, 1, sizeof(bytes), stdout);
+}
+
+/* Writes one burst (big endian payload words), padded out to the
+ * period with zeros. The total is always a whole number of 8 channel
+ * frames since every period is a multiple of 8 words.
+ */
+static void put_burst(uint16_t pc, size_t len, uint32_t period_words)
+{
+    size_t i;
+    uint32_t words;
+
+    for (i = 0; i < 4u; i++) {
+        put_word(0);
+    }
+    put_word(SYNC_WORD_0);
+    put_word(SYNC_WORD_1);
+    put_word(pc);
+    put_word((uint16_t)len);
+
+    for (i = 0; i < len; i += 2u) {
+        put_word(((uint16_t)payload[i] << 8u) | (((i + 1u) < len) ? payload[i + 1u] : 0));
+    }
+
+    words = 8u + ((len + 1u) / 2u);
+    for (; words < period_words; words++) {
+        put_word(0);
+    }
+}
+
+/* Fills hd_data with the next frame's worth of access units. Returns
+ * the number of bytes, or 0 at the end of the input.
+ */
+static size_t read_access_units(FILE *in)
+{
+    size_t len = 0;
+    size_t au_len;
+    uint32_t i;
+
+    for (i = 0; i < MAT_AUS_PER_FRAME; i++) {
+        if (fread(&hd_data[len], 1, 2u, in) != 2u) {
+            break;
+        }
+
+        au_len = ((((size_t)hd_data[len] & 0x0F) << 8u) | hd_data[len + 1u]) * 2u;
+        if ((au_len < 4u) || ((len + au_len) > sizeof(hd_data)) ||
+            (fread(&hd_data[len + 2u], 1, au_len - 2u, in) != (au_len - 2u))) {
+            break;
+        }
+
+        len += au_len;
+    }
+
+    return len;
+}
+
+/* Fills hd_data with synthetic access units: a length word followed
+ * by a counting pattern.
+ */
+static size_t make_access_units(uint32_t nr_aus, uint32_t seq)
+{
+    size_t len = 0;
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < nr_aus; i++) {
+        hd_data[len] = 0xF0 | ((SYNTHETIC_AU_SIZE / 2u) >> 8u);
+        hd_data[len + 1u] = (SYNTHETIC_AU_SIZE / 2u) & 0xFF;
+        for (j = 2u; j < SYNTHETIC_AU_SIZE; j++) {
+            hd_data[len + j] = (uint8_t)(seq + i + j);
+        }
+        len += SYNTHETIC_AU_SIZE;
+    }
+
+    return len;
+}
+
+/* Packs TrueHD data into a MAT frame. If it's too large for a regular
+ * frame, the frame is grown to fit (which is only useful for testing
+ * the sink's size check).
+ */
+static void put_mat_burst(size_t hd_len)
+{
+    size_t first;
+    size_t len;
+    size_t capacity = MAT_PAYLOAD_SIZE - sizeof(mat_start_code) -
+                      sizeof(mat_middle_code) - sizeof(mat_end_code);
+
+    len = MAT_PAYLOAD_SIZE;
+    if (hd_len > capacity) {
+        len += hd_len - capacity;
+    }
+    if (len > sizeof(payload)) {
+        fprintf(stderr, "Too much TrueHD data for one burst (%zu)\n", hd_len);
+        return;
+    }
+
+    memset(payload, 0, len);
+    memcpy(payload, mat_start_code, sizeof(mat_start_code));
+
+    /* Data before the middle code, then after it, then padding. */
+    first = MAT_MIDDLE_OFFSET - sizeof(mat_start_code);
+    if (first > hd_len) {
+        first = hd_len;
+    }
+    memcpy(&payload[sizeof(mat_start_code)], hd_data, first);
+    memcpy(&payload[MAT_MIDDLE_OFFSET], mat_middle_code, sizeof(mat_middle_code));
+    memcpy(&payload[MAT_MIDDLE_OFFSET + sizeof(mat_middle_code)], &hd_data[first], hd_len - first);
+    memcpy(&payload[len - sizeof(mat_end_code)], mat_end_code, sizeof(mat_end_code));
+
+    put_burst(DATA_TYPE_MAT, len, MAT_PERIOD_WORDS);
+}
+
+static void put_dtshd_burst(uint32_t seq)
+{
+    size_t i;
+    size_t len = sizeof(dtshd_start_code) + 2u + DTSHD_FRAME_SIZE;
+
+    memcpy(payload, dtshd_start_code, sizeof(dtshd_start_code));
+    payload[sizeof(dtshd_start_code)] = DTSHD_FRAME_SIZE >> 8u;
+    payload[sizeof(dtshd_start_code) + 1u] = DTSHD_FRAME_SIZE & 0xFF;
+
+    /* Core sync word, then a counting pattern. */
+    payload[sizeof(dtshd_start_code) + 2u] = 0x7F;
+    payload[sizeof(dtshd_start_code) + 3u] = 0xFE;
+    payload[sizeof(dtshd_start_code) + 4u] = 0x80;
+    payload[sizeof(dtshd_start_code) + 5u] = 0x01;
+    for (i = sizeof(dtshd_start_code) + 6u; i < len; i++) {
+        payload[i] = (uint8_t)(seq + i);
+    }
+
+    put_burst(DATA_TYPE_DTSHD | (DTSHD_PERIOD_CODE << 8u), len, DTSHD_PERIOD_WORDS);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in = NULL;
+    size_t hd_len;
+    uint32_t i;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s mat [file.thd] | mat-oversize | dtshd\n", argv[0]);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "mat")) {
+        if (argc > 2) {
+            in = fopen(argv[2], "rb");
+            if (!in) {
+                perror(argv[2]);
+                return 1;
+            }
+
+            while ((hd_len = read_access_units(in))) {
+                put_mat_burst(hd_len);
+            }
+
+            fclose(in);
+        } else {
+            for (i = 0; i < 250u; i++) {
+                put_mat_burst(make_access_units(MAT_AUS_PER_FRAME, i));
+            }
+        }
+    } else if (!strcmp(argv[1], "mat-oversize")) {
+        for (i = 0; i < 250u; i++) {
+            put_mat_burst(make_access_units(MAT_AUS_PER_FRAME + 8u, i));
+        }
+    } else if (!strcmp(argv[1], "dtshd")) {
+        for (i = 0; i < 2000u; i++) {
+            put_dtshd_burst(i);
+        }
+    } else {
+        fprintf(stderr, "Unknown mode: %s\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ * This file is part of audio_async_loopback
+ * Copyright (c) 2020 Jacob Moroni.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures the CPU time that sink_core_queue() takes for the PCM path
+ * (PCM_SINK_CHANNELS in input sized chunks) and the 5.1 compressed path
+ * (6 channels in AC3 sized frames), with whatever DRIFT_COMP_MODE and
+ * TIME_STRETCH settings are in config.h. No Pulseaudio server is needed:
+ * pa_output is replaced by a consumer that takes the frames out exactly
+ * as fast as they're queued, so the buffer level stays around the
+ * target just like it would when running in real time.
+ *
+ * Build (from the top of the tree):
+ *   gcc -o sink_bench -I. tools/sink_bench.c sink_core.c rate_loop.c \
+ *       resampler.c frame_slip.c time_stretch.c -lsamplerate -lpthread \
+ *       -lm -Wall -O3 -flto
+ *
+ * To compare the drift compensation modes on the same workload, build
+ * it once per mode with -DDRIFT_COMP_MODE=DRIFT_COMP_SRC,
+ * DRIFT_COMP_SERVER and so on. In DRIFT_COMP_SERVER mode, this only
+ * counts what the loopback itself spends. The server's resampler does
+ * the rest, and it already runs whenever the stream and sink rates
+ * differ.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "sink_core.h"
+#include "pa_output.h"
+
+#define BENCH_RATE                     48000u
+#define BENCH_SECONDS                  60u
+#define BENCH_COMPRESSED_CHANNELS      6u
+#define BENCH_COMPRESSED_FRAMES        1536u
+#define BENCH_PCM_FRAMES               (INPUT_CHUNK_SIZE / (INPUT_CHANNELS * INPUT_SAMPLE_BYTES))
+
+#if DRIFT_COMP_MODE == DRIFT_COMP_SRC
+#define BENCH_MODE_STR                 "DRIFT_COMP_SRC"
+#elif DRIFT_COMP_MODE == DRIFT_COMP_SERVER
+#define BENCH_MODE_STR                 "DRIFT_COMP_SERVER"
+#elif DRIFT_COMP_MODE == DRIFT_COMP_SRC_PULL
+#define BENCH_MODE_STR                 "DRIFT_COMP_SRC_PULL"
+#else
+#define BENCH_MODE_STR                 "DRIFT_COMP_SLIP"
+#endif
+
+/* Frames that the consumer is allowed to take out. */
+static pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t consumer_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t consumer_credit;
+static bool consumer_stop;
+static bool consumer_waiting;
+static uint32_t consumer_frame_bytes;
+
+int pa_output_open(struct pa_output *inst,
+                   const pa_sample_spec *ss,
+                   const pa_channel_map *map,
+                   const pa_buffer_attr *attr,
+                   bool variable_rate)
+{
+    (void)inst;
+    (void)map;
+    (void)attr;
+    (void)variable_rate;
+
+    consumer_frame_bytes = ss->channels * sizeof(float);
+
+    return 0;
+}
+
+void pa_output_close(struct pa_output *inst)
+{
+    (void)inst;
+}
+
+void pa_output_flush(struct pa_output *inst)
+{
+    (void)inst;
+}
+
+void pa_output_set_ratio(struct pa_output *inst, double ratio)
+{
+    (void)inst;
+    (void)ratio;
+}
+
+/* Blocks until enough frames have been queued to cover the write. */
+int pa_output_write(struct pa_output *inst, const void *data, size_t bytes)
+{
+    const uint64_t frames = bytes / consumer_frame_bytes;
+
+    (void)inst;
+    (void)data;
+
+    pthread_mutex_lock(&consumer_lock);
+    while ((consumer_credit < frames) && !consumer_stop) {
+        consumer_waiting = true;
+        pthread_cond_broadcast(&consumer_cond);
+        pthread_cond_wait(&consumer_cond, &consumer_lock);
+    }
+    consumer_waiting = false;
+    if (!consumer_stop) {
+        consumer_credit -= frames;
+    }
+    pthread_mutex_unlock(&consumer_lock);
+
+    return 0;
+}
+
+/* Lets the consumer take out another nr_frames, and waits until it has
+ * taken out all that it can (which is what happens between blocks when
+ * running in real time). The timeout covers the consumer waiting on the
+ * ring buffer instead.
+ */
+static void consumer_add(uint64_t frames, bool stop)
+{
+    struct timespec timeout;
+
+    pthread_mutex_lock(&consumer_lock);
+    consumer_credit += frames;
+    consumer_stop = stop;
+    consumer_waiting = false;
+    pthread_cond_broadcast(&consumer_cond);
+
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += 10000000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
+    while (!consumer_waiting && !stop) {
+        if (pthread_cond_timedwait(&consumer_cond, &consumer_lock, &timeout)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&consumer_lock);
+}
+
+/* Queue BENCH_SECONDS of a tone in blocks of nr_frames, and print the
+ * average time per frame.
+ */
+static void run(const char *name,
+                struct sink_core *core,
+                const struct sink_core_config *config,
+                uint32_t channels,
+                uint32_t nr_frames,
+                float *in)
+{
+    uint32_t i;
+    uint32_t ch;
+    uint32_t block;
+    uint64_t start;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t ns;
+    pa_channel_map map;
+    struct sink_core_stats stats;
+    const uint32_t nr_blocks = (BENCH_SECONDS * BENCH_RATE) / nr_frames;
+
+    for (i = 0; i < nr_frames; i++) {
+        for (ch = 0; ch < channels; ch++) {
+            in[(i * channels) + ch] = 0.5f * sinf((2.0f * (float)M_PI * 440.0f * (i + ch)) / BENCH_RATE);
+        }
+    }
+
+    consumer_credit = 0;
+    consumer_stop = false;
+    consumer_waiting = false;
+
+    /* Only the stubbed out pa_output_open() sees it. */
+    memset(&map, 0, sizeof(map));
+    map.channels = channels;
+
+    sink_core_init(core, config);
+    sink_core_prepare(core, BENCH_RATE, channels);
+    sink_core_open(core, 0, BENCH_RATE, BENCH_RATE, channels, &map);
+
+    total_ns = 0;
+    max_ns = 0;
+    for (block = 0; block < nr_blocks; block++) {
+        start = sink_core_thread_cpu_ns();
+        sink_core_queue(core, in, nr_frames, start);
+        ns = sink_core_thread_cpu_ns() - start;
+
+        total_ns += ns;
+        if (ns > max_ns) {
+            max_ns = ns;
+        }
+
+        consumer_add(nr_frames, false);
+    }
+
+    sink_core_get_stats(core, &stats);
+
+    consumer_add(0, true);
+    sink_core_close(core);
+    sink_core_free(core);
+
+    printf("%s: %u blocks of %u frames, %.1f ns per frame, worst block %.1f us, "
+           "stretch engagements %u, buffer %u\n",
+           name,
+           nr_blocks,
+           nr_frames,
+           (double)total_ns / ((double)nr_blocks * nr_frames),
+           max_ns / 1000.0,
+           stats.stretch_engagements,
+           stats.buffer_used);
+}
+
+static struct sink_core pcm_core;
+static SINK_CORE_STORAGE(PCM_SINK_SAMPLE_BUFFER_SIZE,
+                         PCM_SINK_OUTPUT_CHUNK_SIZE,
+                         INPUT_CHUNK_SIZE * 3,
+                         TIME_STRETCH_BUF_FRAMES * PCM_SINK_CHANNELS) pcm_storage;
+static float pcm_in[BENCH_PCM_FRAMES * PCM_SINK_CHANNELS];
+
+static struct sink_core compressed_core;
+static SINK_CORE_STORAGE(COMPRESSED_SINK_SAMPLE_BUFFER_SIZE,
+                         COMPRESSED_SINK_OUTPUT_CHUNK_SIZE,
+                         8 * 10240,
+                         8 * 10240) compressed_storage;
+static float compressed_in[BENCH_COMPRESSED_FRAMES * BENCH_COMPRESSED_CHANNELS];
+
+int main(void)
+{
+    /* Same settings as pcm_sink_init() and compressed_sink_init(). */
+    struct sink_core_config pcm_config = {
+        .name = "PCM",
+        .pa_buffer_size = PCM_SINK_PA_BUFFER_SIZE,
+        .target = PCM_SINK_BUFFER_TARGET_SAMPLES,
+        .loop_gain = PCM_SINK_LOOP_GAIN,
+        .hist_size = PCM_SINK_BUFFER_HIST_SIZE,
+        .jitter_bucket_width = PCM_SINK_JITTER_BUCKET_WIDTH,
+        .drop_whole_blocks = false,
+    };
+    struct sink_core_config compressed_config = {
+        .name = "61937",
+        .pa_buffer_size = COMPRESSED_SINK_PA_BUFFER_SIZE,
+        .target = COMPRESSED_SINK_BUFFER_TARGET_SAMPLES,
+        .loop_gain = COMPRESSED_SINK_LOOP_GAIN,
+        .hist_size = COMPRESSED_SINK_BUFFER_HIST_SIZE,
+        .jitter_bucket_width = COMPRESSED_SINK_JITTER_BUCKET_WIDTH,
+        .drop_whole_blocks = true,
+    };
+
+    SINK_CORE_CONFIG_STORAGE(&pcm_config, &pcm_storage);
+    SINK_CORE_CONFIG_STORAGE(&compressed_config, &compressed_storage);
+
+    printf("Drift compensation: %s\n", BENCH_MODE_STR);
+
+    run("PCM", &pcm_core, &pcm_config, PCM_SINK_CHANNELS, BENCH_PCM_FRAMES, pcm_in);
+    run("5.1", &compressed_core, &compressed_config,
+        BENCH_COMPRESSED_CHANNELS, BENCH_COMPRESSED_FRAMES, compressed_in);
+
+    return 0;
+}